@@ -0,0 +1,149 @@
+#ifndef RADIO_AUDIO_BATCH_H
+#define RADIO_AUDIO_BATCH_H
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/* Collects consecutive audiograms of equal size and sends them with as few
+ * syscalls as possible: one UDP_SEGMENT (GSO) sendmsg per up to 64 packets when
+ * the kernel accepts it, a single sendmmsg otherwise. Queued packets are only
+ * referenced, so they have to stay untouched until flush() returns. */
+class audio_batch {
+private:
+    static const size_t MAX_GSO_SEGMENTS = 64;
+    static const size_t MAX_GSO_BYTES = 65000; // whole super-datagram must fit in one IP packet
+
+    std::vector<struct iovec> iov;
+    std::vector<struct mmsghdr> msgs;
+    size_t count = 0;
+    size_t max_count = 1;
+    size_t psize = 0;
+    size_t gso_segments = 0; // 0 if GSO is unavailable
+
+    int flush_gso(int sock, const sockaddr_in &addr, size_t &sent) {
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr align;
+        } control;
+
+        while (count - sent > 1) {
+            size_t n = std::min(count - sent, gso_segments);
+            struct msghdr msg = {0};
+            msg.msg_name = (void *)&addr;
+            msg.msg_namelen = sizeof(addr);
+            msg.msg_iov = &iov[sent];
+            msg.msg_iovlen = n;
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = (uint16_t)psize;
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+
+            if (sendmsg(sock, &msg, 0) == -1) {
+                if (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP) {
+                    std::cerr << "GSO rejected (errno = " << errno << "), falling back to sendmmsg\n";
+                    gso_segments = 0;
+                    return 0;
+                }
+                std::cerr << "Error: audiogram sendmsg, errno = " << errno << "\n";
+                return 1;
+            }
+            sent += n;
+        }
+
+        return 0;
+    }
+
+    int flush_mmsg(int sock, const sockaddr_in &addr, size_t &sent) {
+        for (size_t i = sent; i < count; ++i) {
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = (void *)&addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while (sent < count) {
+            int n = sendmmsg(sock, &msgs[sent], (unsigned int)(count - sent), 0);
+            if (n == -1) {
+                std::cerr << "Error: audiogram sendmmsg, errno = " << errno << "\n";
+                return 1;
+            }
+            sent += n;
+        }
+
+        return 0;
+    }
+
+public:
+    void init(int sock, size_t max_count, size_t psize) {
+        this->max_count = max_count > 0 ? max_count : 1;
+        this->psize = psize;
+        iov = std::vector<struct iovec>(this->max_count);
+        msgs = std::vector<struct mmsghdr>(this->max_count);
+        count = 0;
+
+        /* probe for UDP GSO, the per-call cmsg is used afterwards */
+        gso_segments = std::min((size_t)MAX_GSO_SEGMENTS, MAX_GSO_BYTES / psize);
+        int optval = (int)psize;
+        if (gso_segments < 2 ||
+            setsockopt(sock, SOL_UDP, UDP_SEGMENT, (void *)&optval, sizeof(optval)) < 0) {
+            gso_segments = 0;
+        } else {
+            optval = 0;
+            setsockopt(sock, SOL_UDP, UDP_SEGMENT, (void *)&optval, sizeof(optval));
+        }
+    }
+
+    bool uses_gso() const {
+        return gso_segments != 0;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    bool full() const {
+        return count == max_count;
+    }
+
+    /* queues a psize-long packet, returns 1 if the batch is full afterwards */
+    int add(uint8_t *packet) {
+        iov[count].iov_base = (void *)packet;
+        iov[count].iov_len = psize;
+        ++count;
+        return full();
+    }
+
+    int flush(int sock, const sockaddr_in &addr) {
+        size_t sent = 0;
+        int err = 0;
+
+        if (gso_segments)
+            err = flush_gso(sock, addr, sent);
+        if (!err && sent < count)
+            err = flush_mmsg(sock, addr, sent);
+
+        count = 0;
+        return err;
+    }
+};
+
+
+#endif //RADIO_AUDIO_BATCH_H
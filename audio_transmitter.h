@@ -2,6 +2,10 @@
 #define RADIO_UDP_TRANSMITTER_H
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
 #include <chrono>
 #include <cerrno>
 #include <sys/socket.h>
@@ -9,6 +13,8 @@
 #include <arpa/inet.h>
 #include "boost/program_options.hpp"
 #include "audiogram.h"
+#include "station.h"
+#include "codec.h"
 #include "transmitter.h"
 #include "const.h"
 
@@ -18,31 +24,78 @@ protected:
     static const in_addr_t MAX_MCAST_ADDR_VAL = 0xEFFFFFFF; // 239.255.255.255
     static const size_t MAX_NAME_LEN = 64;
 
-    struct sockaddr_in mcast_addr = {0};
     std::string mcast_addr_dotted = "";
     in_port_t data_port = (in_port_t)25826;
     in_port_t ctrl_port = (in_port_t)35826;
     size_t psize = 512;
     size_t fsize = 128 * 1000 * 1000 * 10;
+    size_t batch_size = 32;
+    double rate = 0; // wire bytes per second, 0 sends as fast as input comes
+    std::string input_path = ""; // stdin if empty
+    bool hugepages = false;
+    std::string fifo_path = ""; // FIFO kept in memory only if empty
+    unsigned int rexmit_share = 50; // percent of the live rate retransmissions may use
+    size_t jitter_size = 0; // receivers' buffer in bytes, 0 if unknown
+    size_t ingest_depth = 1024; // audiograms the reader may build ahead of the sender
+    int reader_cpu = -1;
+    int sender_cpu = -1;
+    size_t send_workers = 1;
+    size_t fec_block = 0; // audiograms per parity packet, 0 sends no parity
+    size_t unicast_limit = 1; // most requesters a repair goes to by unicast, 0 always multicasts
+    unsigned int codec_channels = 0; // channels of the PCM coded to IMA-ADPCM, 0 sends input as is
+    int silence_threshold = -1; // 16-bit PCM peak up to which audiograms are not sent, -1 sends all
+    unsigned int catch_up_share = 400; // percent of the live rate catch-up bursts may use, 0 answers none
+    bool nack_group = false; // receivers share requests on a group, repaired by multicast whatever -u says
+    double reply_rate = 1000; // lookup replies per second
+    unsigned int reply_window = 1000; // ms between replies to the same source
+    in_port_t stats_port = 0; // local TCP port serving metrics, 0 serves none
+    unsigned int stats_dump = 0; // seconds between metrics dumps to stderr, 0 dumps none
     std::chrono::milliseconds rtime = std::chrono::milliseconds(250);
     std::string name = "Nienazwany Nadajnik";
-    transmitter audio_tr;
-    transmitter replies_tr;
+    transmitter audio_tr; // shared by all stations
+    std::vector<station_spec> specs;
 
     virtual int init(int argc, char *argv[]) {
         namespace po = boost::program_options;
         int time = 250;
+        std::string sample_format = "";
+        std::string codec = "raw";
+        unsigned int sample_bits = 0;
+        std::vector<std::string> extra_stations;
 
         po::options_description desc("Options");
         desc.add_options()
-                (",a", po::value<std::string>(&mcast_addr_dotted)->required(),
-                 "mcast_addr")
+                (",a", po::value<std::string>(&mcast_addr_dotted), "mcast_addr")
                 (",P", po::value<in_port_t>(), "data_port")
                 (",C", po::value<in_port_t>(), "ctrl_port")
                 (",p", po::value<size_t>(&psize), "psize")
                 (",f", po::value<size_t>(&fsize), "fsize")
                 (",r", po::value<int>(&time), "rtime")
-                (",n", po::value<std::string>(&name), "name");
+                (",n", po::value<std::string>(&name), "name")
+                (",B", po::value<size_t>(&batch_size), "batch")
+                (",R", po::value<double>(&rate), "rate")
+                (",s", po::value<std::string>(&sample_format), "sample_rate:bits:channels")
+                (",i", po::value<std::string>(&input_path), "input file")
+                (",H", po::bool_switch(&hugepages), "hugepages")
+                (",m", po::value<std::string>(&fifo_path), "fifo file")
+                (",x", po::value<unsigned int>(&rexmit_share), "rexmit share")
+                (",j", po::value<size_t>(&jitter_size), "receiver bsize")
+                (",q", po::value<size_t>(&ingest_depth), "ingest depth")
+                (",c", po::value<int>(&reader_cpu), "reader cpu")
+                (",w", po::value<int>(&sender_cpu), "sender cpu")
+                (",l", po::value<double>(&reply_rate), "reply rate")
+                (",L", po::value<unsigned int>(&reply_window), "reply window")
+                (",S", po::value<std::vector<std::string>>(&extra_stations),
+                 "station mcast_addr:data_port:input:name")
+                (",W", po::value<size_t>(&send_workers), "send workers")
+                (",F", po::value<size_t>(&fec_block), "fec block")
+                (",u", po::value<size_t>(&unicast_limit), "unicast repair limit")
+                (",e", po::value<std::string>(&codec), "codec (raw, ima-adpcm)")
+                (",D", po::value<int>(&silence_threshold), "silence threshold")
+                (",k", po::value<unsigned int>(&catch_up_share), "catch-up share")
+                (",g", po::bool_switch(&nack_group), "nack group")
+                (",M", po::value<in_port_t>(&stats_port), "metrics port")
+                (",T", po::value<unsigned int>(&stats_dump), "metrics dump interval");
 
         po::variables_map vm;
         try {
@@ -53,11 +106,8 @@ protected:
             return 1;
         }
 
-        if (!inet_pton(AF_INET, mcast_addr_dotted.c_str(), &mcast_addr.sin_addr)/* ||
-            mcast_addr.sin_addr.s_addr < htonl(MIN_MCAST_ADDR_VAL) ||
-            mcast_addr.sin_addr.s_addr > htonl(MAX_MCAST_ADDR_VAL) */) {
-            std::cerr << "the argument ('" << inet_ntoa(mcast_addr.sin_addr) <<
-                      "') for option '-a' is invalid\n";
+        if (mcast_addr_dotted.empty() && extra_stations.empty()) {
+            std::cerr << "the option '-a' is required but missing\n";
             return 1;
         }
         if (data_port == 0) {
@@ -68,66 +118,160 @@ protected:
             std::cerr << "the argument ('0') for option '--C' is invalid\n";
             return 1;
         }
-        if (psize == 0) {
-            std::cerr << "the argument ('0') for option '--p' is invalid\n";
+        if (psize <= audiogram::HEADER_SIZE) {
+            std::cerr << "the argument ('" << psize << "') for option '--p' is invalid\n";
             return 1;
         }
         if (fsize == 0) {
             std::cerr << "the argument ('0') for option '--f' is invalid\n";
             return 1;
         }
+        if (batch_size == 0) {
+            std::cerr << "the argument ('0') for option '--B' is invalid\n";
+            return 1;
+        }
         if (time <= 0) {
             std::cerr << "the argument ('" << time << "') for option '--r' is invalid\n";
             return 1;
         } else {
             rtime = std::chrono::milliseconds(time);
         }
-        if (name.size() > MAX_NAME_LEN) {
-            std::cerr << "the argument ('" << name << "') for option '--n' is invalid\n";
+        if (reply_rate <= 0) {
+            std::cerr << "the argument ('" << reply_rate << "') for option '--l' is invalid\n";
+            return 1;
+        }
+        if (ingest_depth == 0) {
+            std::cerr << "the argument ('0') for option '--q' is invalid\n";
+            return 1;
+        }
+        if (fec_block == 1) {
+            std::cerr << "the argument ('1') for option '--F' is invalid\n";
+            return 1;
+        }
+        if (unicast_limit > rexmit_requesters::MAX_LIMIT) {
+            std::cerr << "the argument ('" << unicast_limit << "') for option '--u' is invalid\n";
+            return 1;
+        }
+        if (send_workers == 0) {
+            std::cerr << "the argument ('0') for option '--W' is invalid\n";
+            return 1;
+        }
+        if (rexmit_share == 0 || rexmit_share > 100) {
+            std::cerr << "the argument ('" << rexmit_share << "') for option '--x' is invalid\n";
+            return 1;
+        }
+        if (rate < 0) {
+            std::cerr << "the argument ('" << rate << "') for option '--R' is invalid\n";
+            return 1;
+        }
+        if (!sample_format.empty()) {
+            unsigned int sample_rate, bits, channels;
+            char end;
+            if (sscanf(sample_format.c_str(), "%u:%u:%u%c", &sample_rate, &bits, &channels, &end) != 3 ||
+                sample_rate == 0 || bits == 0 || bits % 8 != 0 || channels == 0) {
+                std::cerr << "the argument ('" << sample_format << "') for option '--s' is invalid\n";
+                return 1;
+            }
+            sample_bits = bits;
+            if (codec == "ima-adpcm") {
+                if (bits != 16 || channels > ima_adpcm::MAX_CHANNELS ||
+                    ima_adpcm::frames_per_payload(psize - audiogram::HEADER_SIZE, channels) == 0) {
+                    std::cerr << "ima-adpcm codes up to " << ima_adpcm::MAX_CHANNELS
+                              << " channels of 16-bit samples, at least one per audiogram\n";
+                    return 1;
+                }
+                codec_channels = channels;
+            }
+            /* the audio rate is paid in payload bytes, headers come on top of it */
+            size_t audio_per_packet = psize - audiogram::HEADER_SIZE;
+            if (codec_channels > 0)
+                audio_per_packet = ima_adpcm::pcm_size(audio_per_packet, codec_channels);
+            if (rate == 0) {
+                rate = (double)sample_rate * bits / 8 * channels * psize / audio_per_packet;
+                /* and so does parity */
+                if (fec_block > 0)
+                    rate = rate * (fec_block * psize + parity_block::parity_size(psize)) / (fec_block * psize);
+            }
+        }
+
+        if (silence_threshold > 32767 || (silence_threshold >= 0 && sample_bits != 16)) {
+            std::cerr << "the argument ('" << silence_threshold << "') for option '--D' is invalid, "
+                      << "it needs '-s' with 16-bit samples\n";
+            return 1;
+        }
+        if (codec != "raw" && codec_channels == 0) {
+            std::cerr << "the argument ('" << codec << "') for option '--e' is invalid"
+                      << (codec == "ima-adpcm" ? ", it needs '-s'\n" : "\n");
+            return 1;
+        }
+
+        if (!mcast_addr_dotted.empty() && add_station(mcast_addr_dotted, data_port, input_path, name, "-a"))
             return 1;
+        for (const std::string &arg : extra_stations) {
+            if (parse_station(arg))
+                return 1;
         }
+        if (send_workers > specs.size())
+            send_workers = specs.size();
 
-        data_port = htons(data_port);
         ctrl_port = htons(ctrl_port);
 
         return prepare_to_send();
     }
 
-    int send_audiogram(audiogram &a) {
-//        for (int i = 0; i < psize + 16; ++i) {
-//            printf("%x", a[i] & 0xff);
-//        } printf("\n");
-        if (sendto(audio_tr.sock, (void *)a.get_packet_data(), psize, 0,
-                   (struct sockaddr *)&mcast_addr, sizeof(mcast_addr)) == -1) {
-            std::cerr << "Error: audiogram sendto, errno = " << errno << "\n";
+    int add_station(const std::string &addr, in_port_t port, const std::string &input,
+                    const std::string &station_name, const char *option) {
+        struct in_addr parsed;
+        if (!inet_pton(AF_INET, addr.c_str(), &parsed)/* ||
+            parsed.s_addr < htonl(MIN_MCAST_ADDR_VAL) ||
+            parsed.s_addr > htonl(MAX_MCAST_ADDR_VAL) */) {
+            std::cerr << "the argument ('" << addr << "') for option '" << option << "' is invalid\n";
             return 1;
         }
+        if (station_name.size() > MAX_NAME_LEN) {
+            std::cerr << "the argument ('" << station_name << "') for option '" << option << "' is invalid\n";
+            return 1;
+        }
+        for (const station_spec &spec : specs) {
+            if (input.empty() && spec.input_path.empty()) {
+                std::cerr << "only one station may read the standard input\n";
+                return 1;
+            }
+        }
 
+        specs.push_back({addr, htons(port), station_name, input});
         return 0;
     }
 
-    void send_reply(sockaddr_in &addr) {
-        // BOREWICZ_HERE [MCAST_ADDR] [DATA_PORT] [nazwa stacji]
-        char msg[MAX_CTRL_MSG_LEN];
-        int msg_size = sprintf(msg, "%s %s %d %s\n", REPLY_MSG,
-                mcast_addr_dotted.data(), data_port, name.data());
-        std::cerr << "Reply " << msg << " to " << inet_ntoa(addr.sin_addr) << "\n";
-        if (msg_size < 0)
-            return;
+    /* mcast_addr:data_port:input:name, an empty port means -P and an empty input stdin */
+    int parse_station(const std::string &arg) {
+        size_t first = arg.find(':');
+        size_t second = first == std::string::npos ? first : arg.find(':', first + 1);
+        size_t third = second == std::string::npos ? second : arg.find(':', second + 1);
+        if (third == std::string::npos) {
+            std::cerr << "the argument ('" << arg << "') for option '--S' is invalid\n";
+            return 1;
+        }
 
-        if (sendto(replies_tr.sock, (void*)&msg, (size_t)msg_size, 0,
-                   (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-            std::cerr << "Error: reply sendto, errno = " << errno << "\n";
+        in_port_t port = data_port;
+        std::string port_str = arg.substr(first + 1, second - first - 1);
+        if (!port_str.empty()) {
+            char *end;
+            unsigned long value = strtoul(port_str.c_str(), &end, 10);
+            if (*end != '\0' || value == 0 || value > 65535) {
+                std::cerr << "the argument ('" << arg << "') for option '--S' is invalid\n";
+                return 1;
+            }
+            port = (in_port_t)value;
         }
+
+        return add_station(arg.substr(0, first), port, arg.substr(second + 1, third - second - 1),
+                           arg.substr(third + 1), "--S");
     }
 
 private:
     int prepare_to_send() override {
         audio_tr.prepare_to_send();
-        replies_tr.prepare_to_send();
-
-        mcast_addr.sin_family = AF_INET;
-        mcast_addr.sin_port = data_port;
 
         return transmitter::prepare_to_send();
     }
@@ -68,6 +68,20 @@ public:
         this->fresh = fresh;
     }
 
+    /* writes the header of a packet stored outside of an audiogram object */
+    static void set_header(uint8_t *packet, uint64_t session_id, uint64_t packet_id) {
+        *(uint64_t *)packet = htonll(session_id);
+        *(uint64_t *)(packet + sizeof(uint64_t)) = htonll(packet_id);
+    }
+
+    static uint64_t session_id_of(const uint8_t *packet) {
+        return ntohll(*(const uint64_t *)packet);
+    }
+
+    static uint64_t packet_id_of(const uint8_t *packet) {
+        return ntohll(*(const uint64_t *)(packet + sizeof(uint64_t)));
+    }
+
     static inline uint64_t htonll(const uint64_t x) {
         return (1 == htonl(1)) ? x : ((uint64_t)htonl((uint32_t)(x & 0xFFFFFFFF)) << 32u) | htonl((uint32_t)(x >> 32u));
     }
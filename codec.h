@@ -0,0 +1,199 @@
+#ifndef RADIO_CODEC_H
+#define RADIO_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <netinet/in.h>
+#include "input_source.h"
+
+/* line a sender appends to its lookup reply when its audiograms carry
+ * IMA-ADPCM, followed by the number of channels and "\n" */
+#define CODEC_REPLY_EXT "+codec=ima-adpcm:"
+/* A coded station sends its audiograms, parity, shared requests and silence
+ * markers CODEC_PORT_OFFSET ports above the data port of its reply's first
+ * line, so receivers that do not know the codec line hear nothing there
+ * instead of playing the nibbles as PCM. */
+static const in_port_t CODEC_PORT_OFFSET = 4;
+
+/* IMA-ADPCM, 4 bits per 16-bit little-endian PCM sample. Every payload starts
+ * with the coder state of each channel (predictor, 2 bytes little-endian, step
+ * index, 1 byte, one byte unused), followed by the samples, channels
+ * interleaved, two to a byte, low nibble first. Payloads decode on their own,
+ * so a lost audiogram costs only its own samples. */
+class ima_adpcm {
+public:
+    static const size_t MAX_CHANNELS = 8;
+    static const size_t CHANNEL_HEADER_SIZE = 4;
+
+private:
+    struct state {
+        int predictor = 0;
+        int index = 0;
+    };
+
+    unsigned int channels = 0;
+    state states[MAX_CHANNELS];
+
+    static const int16_t *steps() {
+        static const int16_t table[89] = {
+                7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+                50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+                253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+                1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+                3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+                12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+        return table;
+    }
+
+    static int next_index(int index, uint8_t nibble) {
+        static const int8_t moves[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+        index += moves[nibble & 7];
+        return index < 0 ? 0 : (index > 88 ? 88 : index);
+    }
+
+    static int clamp16(int value) {
+        return value < -32768 ? -32768 : (value > 32767 ? 32767 : value);
+    }
+
+    /* the difference a nibble stands for at the given step */
+    static int delta_of(uint8_t nibble, int step) {
+        int delta = step >> 3;
+        if (nibble & 4)
+            delta += step;
+        if (nibble & 2)
+            delta += step >> 1;
+        if (nibble & 1)
+            delta += step >> 2;
+        return nibble & 8 ? -delta : delta;
+    }
+
+    static uint8_t encode_sample(state &s, int sample) {
+        int step = steps()[s.index];
+        int diff = sample - s.predictor;
+        uint8_t nibble = 0;
+        if (diff < 0) {
+            nibble = 8;
+            diff = -diff;
+        }
+        if (diff >= step) {
+            nibble |= 4;
+            diff -= step;
+        }
+        if (diff >= step >> 1) {
+            nibble |= 2;
+            diff -= step >> 1;
+        }
+        if (diff >= step >> 2)
+            nibble |= 1;
+
+        s.predictor = clamp16(s.predictor + delta_of(nibble, step));
+        s.index = next_index(s.index, nibble);
+        return nibble;
+    }
+
+    static int16_t read16(const uint8_t *p) {
+        return (int16_t)(p[0] | (p[1] << 8));
+    }
+
+public:
+    /* samples of each channel a payload of payload_size bytes holds */
+    static size_t frames_per_payload(size_t payload_size, unsigned int channels) {
+        if (channels == 0 || payload_size <= channels * CHANNEL_HEADER_SIZE)
+            return 0;
+        return (payload_size - channels * CHANNEL_HEADER_SIZE) * 2 / channels;
+    }
+
+    /* PCM bytes coded into a payload of payload_size bytes */
+    static size_t pcm_size(size_t payload_size, unsigned int channels) {
+        return frames_per_payload(payload_size, channels) * channels * sizeof(int16_t);
+    }
+
+    /* number of channels announced by a reply line, 0 if it is not a codec line */
+    static unsigned int parse_reply_line(const char *line) {
+        if (strncmp(line, CODEC_REPLY_EXT, strlen(CODEC_REPLY_EXT)) != 0)
+            return 0;
+        unsigned long channels = strtoul(line + strlen(CODEC_REPLY_EXT), nullptr, 10);
+        return channels <= MAX_CHANNELS ? (unsigned int)channels : 0;
+    }
+
+    static std::string reply_line(unsigned int channels) {
+        return CODEC_REPLY_EXT + std::to_string(channels) + "\n";
+    }
+
+    explicit ima_adpcm(unsigned int channels = 1) : channels(channels) {}
+
+    /* codes frames_per_payload() frames of interleaved PCM into a payload,
+     * carrying the coder state over from the previous payload */
+    void encode(const uint8_t *pcm, uint8_t *payload, size_t payload_size) {
+        size_t frames = frames_per_payload(payload_size, channels);
+        for (unsigned int c = 0; c < channels; ++c) {
+            uint8_t *header = payload + c * CHANNEL_HEADER_SIZE;
+            header[0] = (uint8_t)(states[c].predictor & 0xff);
+            header[1] = (uint8_t)((states[c].predictor >> 8) & 0xff);
+            header[2] = (uint8_t)states[c].index;
+            header[3] = 0;
+        }
+
+        uint8_t *data = payload + channels * CHANNEL_HEADER_SIZE;
+        memset(data, 0, payload_size - channels * CHANNEL_HEADER_SIZE);
+        size_t samples = frames * channels;
+        for (size_t i = 0; i < samples; ++i) {
+            uint8_t nibble = encode_sample(states[i % channels], read16(pcm + i * sizeof(int16_t)));
+            data[i / 2] |= (uint8_t)(nibble << ((i % 2) * 4));
+        }
+    }
+
+    /* decodes a payload into pcm_size() bytes of interleaved PCM */
+    static void decode(const uint8_t *payload, size_t payload_size, unsigned int channels, uint8_t *pcm) {
+        state s[MAX_CHANNELS];
+        for (unsigned int c = 0; c < channels; ++c) {
+            const uint8_t *header = payload + c * CHANNEL_HEADER_SIZE;
+            s[c].predictor = read16(header);
+            s[c].index = header[2] > 88 ? 88 : header[2];
+        }
+
+        const uint8_t *data = payload + channels * CHANNEL_HEADER_SIZE;
+        size_t samples = frames_per_payload(payload_size, channels) * channels;
+        for (size_t i = 0; i < samples; ++i) {
+            state &st = s[i % channels];
+            uint8_t nibble = (uint8_t)((data[i / 2] >> ((i % 2) * 4)) & 0xf);
+            st.predictor = clamp16(st.predictor + delta_of(nibble, steps()[st.index]));
+            st.index = next_index(st.index, nibble);
+            pcm[i * 2] = (uint8_t)(st.predictor & 0xff);
+            pcm[i * 2 + 1] = (uint8_t)((st.predictor >> 8) & 0xff);
+        }
+    }
+};
+
+/* Codes the PCM of another source into IMA-ADPCM payloads, so the reader
+ * stage builds coded audiograms and nothing after it changes. */
+class adpcm_source : public input_source {
+private:
+    std::unique_ptr<input_source> pcm_source;
+    ima_adpcm coder;
+    unsigned int channels;
+    std::vector<uint8_t> pcm;
+
+public:
+    adpcm_source(std::unique_ptr<input_source> pcm_source, unsigned int channels, size_t payload_size)
+            : pcm_source(std::move(pcm_source)), coder(channels), channels(channels),
+              pcm(ima_adpcm::pcm_size(payload_size, channels)) {}
+
+    int wait_for(size_t) override {
+        return pcm_source->wait_for(pcm.size());
+    }
+
+    int read(uint8_t *dst, size_t len) override {
+        if (pcm_source->read(pcm.data(), pcm.size()))
+            return 1;
+        coder.encode(pcm.data(), dst, len);
+        return 0;
+    }
+};
+
+
+#endif //RADIO_CODEC_H
@@ -0,0 +1,188 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "codec.h"
+#include "receiver.h"
+#include "const.h"
+
+
+/* A receiver that does not know the codec line meets a coded station: it
+ * tunes in where the first line of the reply says and must hear nothing
+ * there, while a receiver that knows the line hears the coded audio
+ * CODEC_PORT_OFFSET ports above. Takes the sender binary to run. */
+class codec_compat_test {
+private:
+    static const in_port_t DATA_PORT = 27826;
+    static const in_port_t CTRL_PORT = 35826; // the sender's default
+    static constexpr const char *GROUP = "239.10.11.99";
+
+    std::string sender_path;
+    char input_path[32] = "/tmp/codec-compat-XXXXXX";
+    pid_t sender = -1;
+
+    /* a few seconds of a loud stereo tone, so the coder has something to code */
+    int write_input() {
+        int fd = mkstemp(input_path);
+        if (fd < 0) {
+            std::cerr << "Error: input mkstemp, errno = " << errno << "\n";
+            return 1;
+        }
+        std::vector<int16_t> pcm(44100 * 2 * 4);
+        for (size_t i = 0; i < pcm.size(); ++i)
+            pcm[i] = (int16_t)(12000 * std::sin((double)(i / 2) * 0.05));
+        ssize_t len = write(fd, pcm.data(), pcm.size() * sizeof(int16_t));
+        close(fd);
+        return len != (ssize_t)(pcm.size() * sizeof(int16_t));
+    }
+
+    int start_sender() {
+        std::string station = std::string(GROUP) + ":" + std::to_string(DATA_PORT) + ":" + input_path + ":coded";
+        sender = fork();
+        if (sender < 0) {
+            std::cerr << "Error: fork, errno = " << errno << "\n";
+            return 1;
+        }
+        if (sender == 0) {
+            execl(sender_path.c_str(), sender_path.c_str(), "-S", station.c_str(), "-e", "ima-adpcm",
+                  "-s", "44100:16:2", "-R", "100000", (char *)nullptr);
+            _exit(127);
+        }
+        return 0;
+    }
+
+    /* the station's lookup reply, retried while the sender starts */
+    std::string lookup() {
+        receiver rcv;
+        rcv.prepare_to_receive();
+        struct timeval timeout = {0, 200000};
+        setsockopt(rcv.sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout, sizeof(timeout));
+        fcntl(rcv.sock, F_SETFL, 0);
+
+        struct sockaddr_in ctrl_addr = {0};
+        ctrl_addr.sin_family = AF_INET;
+        ctrl_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ctrl_addr.sin_port = htons(CTRL_PORT);
+        char buffer[MAX_CTRL_MSG_LEN + 1];
+        for (int attempt = 0; attempt < 25; ++attempt) {
+            sendto(rcv.sock, LOOKUP_MSG, LOOKUP_MSG_LEN, 0, (struct sockaddr *)&ctrl_addr, sizeof(ctrl_addr));
+            ssize_t len = recv(rcv.sock, buffer, MAX_CTRL_MSG_LEN, 0);
+            if (len > 0)
+                return std::string(buffer, (size_t)len);
+        }
+        return "";
+    }
+
+    /* where a receiver without codec support tunes in: the address and the
+     * port (network order) of the first line, extension lines unread */
+    static int first_line_addr(const std::string &reply, struct sockaddr_in &addr) {
+        char line[MAX_CTRL_MSG_LEN + 1];
+        strncpy(line, reply.c_str(), MAX_CTRL_MSG_LEN);
+        line[MAX_CTRL_MSG_LEN] = '\0';
+        strtok(line, " ");
+        char *token = strtok(nullptr, " ");
+        if (token == nullptr || !inet_pton(AF_INET, token, &addr.sin_addr))
+            return 1;
+        token = strtok(nullptr, " ");
+        if (token == nullptr)
+            return 1;
+        addr.sin_family = AF_INET;
+        addr.sin_port = (in_port_t)strtoul(token, nullptr, 10);
+        return 0;
+    }
+
+    static unsigned int codec_channels(const std::string &reply) {
+        size_t at = reply.find("\n+codec=");
+        return at == std::string::npos ? 0 : ima_adpcm::parse_reply_line(reply.c_str() + at + 1);
+    }
+
+    static size_t drain(int sock) {
+        char buffer[MAX_UDP_MSG_LEN];
+        size_t datagrams = 0;
+        while (recv(sock, buffer, sizeof(buffer), 0) > 0)
+            ++datagrams;
+        return datagrams;
+    }
+
+    void stop_sender() {
+        if (sender > 0) {
+            kill(sender, SIGTERM);
+            waitpid(sender, nullptr, 0);
+            sender = -1;
+        }
+        unlink(input_path);
+    }
+
+public:
+    ~codec_compat_test() {
+        stop_sender();
+    }
+
+    int init(int argc, char *argv[]) {
+        if (argc < 2) {
+            std::cerr << "usage: " << argv[0] << " sender_binary\n";
+            return 1;
+        }
+        sender_path = argv[1];
+        return write_input() || start_sender();
+    }
+
+    int work() {
+        std::string reply = lookup();
+        if (reply.empty()) {
+            std::cerr << "FAIL: the coded station did not answer the lookup\n";
+            return 1;
+        }
+
+        struct sockaddr_in old_addr = {0};
+        if (first_line_addr(reply, old_addr) || ntohs(old_addr.sin_port) != DATA_PORT) {
+            std::cerr << "FAIL: the first line does not name the data port: " << reply;
+            return 1;
+        }
+        if (codec_channels(reply) != 2) {
+            std::cerr << "FAIL: no codec line for 2 channels: " << reply;
+            return 1;
+        }
+        struct sockaddr_in coded_addr = old_addr;
+        coded_addr.sin_port = htons((in_port_t)(DATA_PORT + CODEC_PORT_OFFSET));
+
+        receiver old_rcv, coded_rcv;
+        if (old_rcv.prepare_to_receive_group(old_addr) || coded_rcv.prepare_to_receive_group(coded_addr))
+            return 1;
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        size_t old_heard = drain(old_rcv.sock), coded_heard = drain(coded_rcv.sock);
+        stop_sender();
+
+        std::cout << "receiver without codec support: " << old_heard << " datagrams, with it: "
+                  << coded_heard << "\n";
+        if (old_heard > 0) {
+            std::cerr << "FAIL: coded audio reached the port of the first line\n";
+            return 1;
+        }
+        if (coded_heard == 0) {
+            std::cerr << "FAIL: no coded audio CODEC_PORT_OFFSET above the data port\n";
+            return 1;
+        }
+        return 0;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    codec_compat_test t;
+    if (t.init(argc, argv)) return 1;
+
+    return t.work();
+}
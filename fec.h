@@ -0,0 +1,111 @@
+#ifndef RADIO_FEC_H
+#define RADIO_FEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "audiogram.h"
+
+/* XOR parity over blocks of k consecutive audiograms. A parity packet starts
+ * like an audiogram (session id, id of the first packet of the block), then
+ * holds the block length and the XOR of the payloads of the block, so any one
+ * packet missing from a block can be rebuilt from the others. Parity travels
+ * to data_port + 1 of the station's group, receivers unaware of it never see it. */
+class parity_block {
+public:
+    static const size_t EXTRA_HEADER_SIZE = 8;
+
+private:
+    size_t k = 0;
+    size_t psize = 0;
+    size_t count = 0;
+    std::vector<uint8_t> packet;
+
+public:
+    static size_t parity_size(size_t psize) {
+        return psize + EXTRA_HEADER_SIZE;
+    }
+
+    /* dst ^= src, word by word so the compiler can vectorize it */
+    static void xor_into(uint8_t *dst, const uint8_t *src, size_t len) {
+        size_t words = len / sizeof(uint64_t);
+        for (size_t i = 0; i < words; ++i) {
+            uint64_t d, s;
+            memcpy(&d, dst + i * sizeof(uint64_t), sizeof(d));
+            memcpy(&s, src + i * sizeof(uint64_t), sizeof(s));
+            d ^= s;
+            memcpy(dst + i * sizeof(uint64_t), &d, sizeof(d));
+        }
+        for (size_t i = words * sizeof(uint64_t); i < len; ++i)
+            dst[i] ^= src[i];
+    }
+
+    /* returns 1 if the datagram is not a parity packet for audiograms of psize bytes */
+    static int parse(const uint8_t *data, size_t len, size_t psize,
+                     uint64_t &session_id, uint64_t &first_id, size_t &block) {
+        if (len != parity_size(psize))
+            return 1;
+
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        session_id = audiogram::ntohll(value);
+        first_id = audiogram::packet_id_of(data);
+        memcpy(&value, data + audiogram::HEADER_SIZE, sizeof(value));
+        block = (size_t)audiogram::ntohll(value);
+        return block < 2;
+    }
+
+    static const uint8_t *payload_of(const uint8_t *data) {
+        return data + audiogram::HEADER_SIZE + EXTRA_HEADER_SIZE;
+    }
+
+    void init(size_t k, size_t psize) {
+        this->k = k;
+        this->psize = psize;
+        count = 0;
+        packet = std::vector<uint8_t>(parity_size(psize));
+    }
+
+    bool enabled() const {
+        return k > 1;
+    }
+
+    /* adds a sent audiogram to the block, returns 1 when the block is complete
+     * and its parity packet is ready; blocks start at ids divisible by k * psize */
+    int add(const uint8_t *audio_packet, uint64_t session_id) {
+        uint64_t packet_id = audiogram::packet_id_of(audio_packet);
+        if (count == 0) {
+            if (packet_id / psize % k != 0)
+                return 0;
+            audiogram::set_header(packet.data(), session_id, packet_id);
+            uint64_t block = audiogram::htonll(k);
+            memcpy(packet.data() + audiogram::HEADER_SIZE, &block, sizeof(block));
+            memcpy(packet.data() + audiogram::HEADER_SIZE + EXTRA_HEADER_SIZE,
+                   audio_packet + audiogram::HEADER_SIZE, psize - audiogram::HEADER_SIZE);
+        } else {
+            xor_into(packet.data() + audiogram::HEADER_SIZE + EXTRA_HEADER_SIZE,
+                     audio_packet + audiogram::HEADER_SIZE, psize - audiogram::HEADER_SIZE);
+        }
+
+        if (++count < k)
+            return 0;
+        count = 0;
+        return 1;
+    }
+
+    /* drops the block being built, the next one starts at the next block boundary */
+    void cancel() {
+        count = 0;
+    }
+
+    const uint8_t *data() const {
+        return packet.data();
+    }
+
+    size_t size() const {
+        return packet.size();
+    }
+};
+
+
+#endif //RADIO_FEC_H
@@ -0,0 +1,135 @@
+#ifndef RADIO_INPUT_SOURCE_H
+#define RADIO_INPUT_SOURCE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Where the sender takes audio data from. Payloads are read in fixed-size
+ * pieces; a trailing piece shorter than requested is treated as end of input. */
+class input_source {
+public:
+    virtual ~input_source() = default;
+
+    /* waits until len bytes can be read, returns 1 if end of input comes first */
+    virtual int wait_for(size_t len) = 0;
+
+    /* copies exactly len bytes to dst, returns 1 on end of input */
+    virtual int read(uint8_t *dst, size_t len) = 0;
+};
+
+/* Reads a pipe or other stream in large blocks, so a single read syscall
+ * fills the payloads of many audiograms. */
+class block_source : public input_source {
+private:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    int fd;
+    std::vector<uint8_t> buf;
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+
+    void fill() {
+        if (begin > 0) {
+            memmove(buf.data(), buf.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+
+        ssize_t len = ::read(fd, buf.data() + end, buf.size() - end);
+        if (len > 0) {
+            end += len;
+        } else if (len == 0) {
+            eof = true;
+        } else if (errno != EINTR) {
+            std::cerr << "Error: input read, errno = " << errno << "\n";
+            eof = true;
+        }
+    }
+
+public:
+    block_source(int fd, size_t len) : fd(fd), buf(std::max((size_t)BLOCK_SIZE, 2 * len)) {}
+
+    int wait_for(size_t len) override {
+        while (end - begin < len) {
+            if (eof)
+                return 1;
+            fill();
+        }
+        return 0;
+    }
+
+    int read(uint8_t *dst, size_t len) override {
+        if (wait_for(len))
+            return 1;
+
+        memcpy(dst, buf.data() + begin, len);
+        begin += len;
+        return 0;
+    }
+};
+
+/* Builds payloads straight from the page cache of a mapped regular file,
+ * no syscall is made after open. */
+class mmap_source : public input_source {
+private:
+    const uint8_t *data = nullptr;
+    size_t length = 0;
+    size_t pos = 0;
+
+public:
+    ~mmap_source() override {
+        if (data != nullptr)
+            munmap((void *)data, length);
+    }
+
+    /* maps the whole file open at fd, returns 1 on failure */
+    int open(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            std::cerr << "Error: input is not a regular file\n";
+            return 1;
+        }
+        length = (size_t)st.st_size;
+        if (length == 0)
+            return 0;
+
+        void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "Error: input mmap, errno = " << errno << "\n";
+            return 1;
+        }
+        data = (const uint8_t *)mapped;
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        return 0;
+    }
+
+    int wait_for(size_t len) override {
+        return length - pos < len;
+    }
+
+    int read(uint8_t *dst, size_t len) override {
+        if (length - pos < len)
+            return 1;
+
+        memcpy(dst, data + pos, len);
+        pos += len;
+        return 0;
+    }
+
+    static bool is_regular(int fd) {
+        struct stat st;
+        return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    }
+};
+
+
+#endif //RADIO_INPUT_SOURCE_H
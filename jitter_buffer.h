@@ -0,0 +1,134 @@
+#ifndef RADIO_JITTER_BUFFER_H
+#define RADIO_JITTER_BUFFER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "audiogram.h"
+
+/* The receiver's buffer: one cache-aligned slab of bsize bytes cut into
+ * psize slots used as a ring, and a bitmap with a bit per slot set while it
+ * holds an audiogram not played yet. The slab is allocated once, tuning in
+ * only cuts it anew for the station's packet size. Runs of slots are cleared
+ * and scanned a word of the bitmap at a time. Used by the play thread only. */
+class jitter_buffer {
+public:
+    static const uint64_t NO_PACKET = UINT64_MAX; // packet id of a slot holding nothing
+
+private:
+    static const size_t ALIGNMENT = 64;
+
+    struct slab_free {
+        void operator()(uint8_t *slab) const {
+            free(slab);
+        }
+    };
+
+    std::unique_ptr<uint8_t, slab_free> slab;
+    std::vector<uint64_t> fresh;
+    size_t bytes = 0;
+    size_t slots = 0;
+    size_t psize = 0;
+
+    /* number of consecutive slots from the one given, up to limit, whose bit
+     * is set, or clear if set is false */
+    size_t run(size_t from, size_t limit, bool set) const {
+        size_t n = 0;
+        while (n < limit) {
+            size_t i = (from + n) % slots;
+            size_t avail = std::min((size_t)64 - i % 64, slots - i);
+            uint64_t bits = fresh[i / 64] >> (i % 64);
+            if (!set)
+                bits = ~bits;
+            size_t ones = ~bits == 0 ? 64 : (size_t)__builtin_ctzll(~bits);
+            if (ones < avail)
+                return std::min(n + ones, limit);
+            n += avail;
+        }
+        return limit;
+    }
+
+public:
+    /* allocates the slab for audiograms of at least min_psize bytes */
+    int init(size_t bsize, size_t min_psize) {
+        void *mem = nullptr;
+        size_t len = (bsize + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        if (posix_memalign(&mem, ALIGNMENT, len) != 0)
+            return 1;
+        slab.reset((uint8_t *)mem);
+        bytes = bsize;
+        fresh.assign((bsize / min_psize + 63) / 64 + 1, 0);
+        return 0;
+    }
+
+    /* empties the buffer and cuts it into slots of packet_size bytes */
+    int reset(size_t packet_size) {
+        if (packet_size == 0 || packet_size > bytes)
+            return 1;
+
+        psize = packet_size;
+        slots = bytes / psize;
+        std::fill(fresh.begin(), fresh.begin() + (slots + 63) / 64, 0);
+        for (size_t i = 0; i < slots; ++i)
+            forget(i);
+        return 0;
+    }
+
+    size_t capacity() const {
+        return slots;
+    }
+
+    size_t get_psize() const {
+        return psize;
+    }
+
+    uint8_t *slot(size_t index) {
+        return slab.get() + index * psize;
+    }
+
+    /* true if the slot holds that audiogram, played or not */
+    bool holds(size_t index, uint64_t packet_id) {
+        return audiogram::packet_id_of(slot(index)) == packet_id;
+    }
+
+    void forget(size_t index) {
+        audiogram::set_header(slot(index), 0, NO_PACKET);
+    }
+
+    bool is_fresh(size_t index) const {
+        return (fresh[index / 64] >> (index % 64)) & 1;
+    }
+
+    void set_fresh(size_t index) {
+        fresh[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+
+    /* clears count bits from the one given on, wrapping around */
+    void clear_fresh(size_t from, size_t count) {
+        count = std::min(count, slots);
+        while (count > 0) {
+            size_t i = from % slots;
+            size_t len = std::min({count, (size_t)64 - i % 64, slots - i});
+            uint64_t mask = len == 64 ? ~(uint64_t)0 : (((uint64_t)1 << len) - 1) << (i % 64);
+            fresh[i / 64] &= ~mask;
+            from = i + len;
+            count -= len;
+        }
+    }
+
+    /* consecutive slots holding audiograms to play from the one given on */
+    size_t fresh_run(size_t from, size_t limit) const {
+        return run(from, limit, true);
+    }
+
+    /* consecutive slots holding nothing to play from the one given on */
+    size_t stale_run(size_t from, size_t limit) const {
+        return run(from, limit, false);
+    }
+};
+
+
+#endif //RADIO_JITTER_BUFFER_H
@@ -0,0 +1,49 @@
+#ifndef RADIO_LOOKUP_FILTER_H
+#define RADIO_LOOKUP_FILTER_H
+
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+
+/* Remembers whom a lookup reply went to recently, so repeated lookups from
+ * the same address and port within the window get a single reply. Fixed-size
+ * and direct-mapped: a colliding source just evicts the older entry. */
+class lookup_filter {
+private:
+    struct entry {
+        uint32_t addr;
+        in_port_t port;
+        uint64_t last_ms;
+    };
+
+    std::vector<entry> table;
+    uint64_t window_ms = 0;
+
+public:
+    void init(size_t entries, uint64_t window_ms) {
+        table = std::vector<entry>(entries, entry{0, 0, 0});
+        this->window_ms = window_ms;
+    }
+
+    /* returns true if a reply to the source should be sent now */
+    bool admit(const sockaddr_in &src, uint64_t now_ms) {
+        if (window_ms == 0)
+            return true;
+
+        uint64_t key = ((uint64_t)src.sin_addr.s_addr << 16) | src.sin_port;
+        key *= 0x9E3779B97F4A7C15ull;
+        entry &e = table[(key >> 32) % table.size()];
+
+        if (e.addr == src.sin_addr.s_addr && e.port == src.sin_port && e.last_ms != 0 &&
+            now_ms - e.last_ms < window_ms)
+            return false;
+
+        e.addr = src.sin_addr.s_addr;
+        e.port = src.sin_port;
+        e.last_ms = now_ms;
+        return true;
+    }
+};
+
+
+#endif //RADIO_LOOKUP_FILTER_H
@@ -0,0 +1,163 @@
+#ifndef RADIO_METRICS_H
+#define RADIO_METRICS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/* Histogram of durations written by one thread and read by any. Bucket i
+ * counts samples shorter than 2^i microseconds and not shorter than the
+ * bucket before; the last one takes everything longer. Recording is a few
+ * relaxed stores, no allocation and no read-modify-write. */
+class latency_histogram {
+public:
+    static const size_t BUCKETS = 24; // the last bound is 2^22 us, about 4 s
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> sum_us;
+
+    static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+public:
+    latency_histogram() : sum_us(0) {
+        for (size_t i = 0; i < BUCKETS; ++i)
+            counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    void record(std::chrono::nanoseconds duration) {
+        uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && us >= ((uint64_t)1 << bucket))
+            ++bucket;
+        add(counts[bucket], 1);
+        add(sum_us, us);
+    }
+
+    /* upper bound of the bucket in microseconds, the last one has none */
+    static uint64_t bound_us(size_t bucket) {
+        return (uint64_t)1 << bucket;
+    }
+
+    uint64_t count_in(size_t bucket) const {
+        return counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    uint64_t get_sum_us() const {
+        return sum_us.load(std::memory_order_relaxed);
+    }
+
+    /* bound of the first bucket by which the share q of the samples is
+     * recorded, 0 if there are none */
+    uint64_t quantile_bound_us(double q) const {
+        uint64_t counts[BUCKETS], total = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i] = count_in(i);
+            total += counts[i];
+        }
+        if (total == 0)
+            return 0;
+
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && (double)(cumulative += counts[bucket]) < q * (double)total)
+            ++bucket;
+        return bound_us(bucket);
+    }
+};
+
+/* one value of a metric, labels excepted */
+struct metric_sample {
+    const char *name;
+    const char *help;
+    bool counter; // a gauge otherwise
+    uint64_t value;
+};
+
+/* Formats metrics as plain "name{labels} value" lines, or in the Prometheus
+ * text exposition format, where each family is described once and all of
+ * its samples follow. Runs on the thread answering requests for them, so it
+ * may allocate. */
+class metrics_writer {
+private:
+    std::string &out;
+    bool prometheus;
+
+    void line(const std::string &name, const std::string &labels, const std::string &value) {
+        out.append(name);
+        if (!labels.empty())
+            out.append("{").append(labels).append("}");
+        out.append(" ").append(value).append("\n");
+    }
+
+    static std::string seconds(uint64_t us) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%g", (double)us / 1e6);
+        return buf;
+    }
+
+public:
+    metrics_writer(std::string &out, bool prometheus) : out(out), prometheus(prometheus) {}
+
+    /* label="value", escaped as Prometheus wants it */
+    static std::string label(const char *name, const std::string &value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"')
+                escaped.push_back('\\');
+            if (c == '\n')
+                escaped.append("\\n");
+            else
+                escaped.push_back(c);
+        }
+        return std::string(name) + "=\"" + escaped + "\"";
+    }
+
+    void family(const char *name, const char *help, const char *type) {
+        if (!prometheus)
+            return;
+        out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    void sample(const char *name, const std::string &labels, uint64_t value) {
+        line(name, labels, std::to_string(value));
+    }
+
+    /* cumulative buckets in seconds, their sum and count; plain text gets
+     * the count, the sum and the bucket the median falls in, in microseconds */
+    void histogram(const char *name, const std::string &labels, const latency_histogram &h) {
+        std::string base(name);
+        std::string sep = labels.empty() ? "" : ",";
+        uint64_t counts[latency_histogram::BUCKETS], total = 0;
+        for (size_t i = 0; i < latency_histogram::BUCKETS; ++i) {
+            counts[i] = h.count_in(i);
+            total += counts[i];
+        }
+
+        if (prometheus) {
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < latency_histogram::BUCKETS; ++i) {
+                cumulative += counts[i];
+                std::string bound = i == latency_histogram::BUCKETS - 1 ? "+Inf" :
+                        seconds(latency_histogram::bound_us(i));
+                line(base + "_bucket", labels + sep + "le=\"" + bound + "\"", std::to_string(cumulative));
+            }
+            line(base + "_sum", labels, seconds(h.get_sum_us()));
+            line(base + "_count", labels, std::to_string(total));
+            return;
+        }
+
+        line(base + "_count", labels, std::to_string(total));
+        line(base + "_sum_us", labels, std::to_string(h.get_sum_us()));
+        line(base + "_median_below_us", labels, std::to_string(h.quantile_bound_us(0.5)));
+    }
+};
+
+
+#endif //RADIO_METRICS_H
@@ -0,0 +1,221 @@
+#ifndef RADIO_NACK_H
+#define RADIO_NACK_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "audiogram.h"
+#include "const.h"
+
+/* first chars of NACK_MAGIC, CATCH_UP_MAGIC, LOOKUP_MSG and REXMIT_MSG shall remain different */
+#define NACK_MAGIC "NAK"
+#define CATCH_UP_MAGIC "CUP"
+/* line a sender appends to its lookup reply when it takes binary requests */
+#define NACK_REPLY_EXT "+nack=1\n"
+/* line a sender appends to its lookup reply when it also takes requests sent
+ * to its group at data_port + NACK_GROUP_PORT_OFFSET, where receivers hear
+ * each other's requests and hold back the ones already made */
+#define NACK_GROUP_EXT "+srm=1\n"
+static const in_port_t NACK_GROUP_PORT_OFFSET = 2;
+/* line a sender appends to its lookup reply when it answers catch-up requests */
+#define CATCH_UP_REPLY_EXT "+catchup=1\n"
+
+/* Binary retransmission request, the compact sibling of LOUDER_PLEASE.
+ * After the magic and a version byte come entries of two kinds, all numbers
+ * in network order:
+ *   RANGE   first packet id (8 bytes), number of packets (4 bytes)
+ *   BITMAP  base packet id (8 bytes), length in bytes (1 byte), bitmap;
+ *           bit i (LSB first) stands for base + i * psize
+ * A sender announces it in its lookup reply with NACK_REPLY_EXT; receivers
+ * keep sending text requests to senders that do not. */
+class binary_nack {
+public:
+    static const uint8_t VERSION = 1;
+    static const size_t HEADER_LEN = 4;
+    static const size_t MAX_LEN = 1400; // stays within one datagram on common links
+
+private:
+    static const uint8_t RANGE = 0;
+    static const uint8_t BITMAP = 1;
+    static const size_t RANGE_LEN = 13;
+    static const size_t BITMAP_HEADER_LEN = 10;
+    static const size_t MAX_BITMAP_BYTES = 255;
+    static const size_t MIN_RANGE = 16; // shorter runs go to bitmaps
+
+    static void put64(std::string &out, uint64_t value) {
+        value = audiogram::htonll(value);
+        out.append((const char *)&value, sizeof(value));
+    }
+
+    static void put32(std::string &out, uint32_t value) {
+        value = htonl(value);
+        out.append((const char *)&value, sizeof(value));
+    }
+
+    static uint64_t get64(const uint8_t *data) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        return audiogram::ntohll(value);
+    }
+
+    static uint32_t get32(const uint8_t *data) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return ntohl(value);
+    }
+
+    static void start(std::vector<std::string> &datagrams) {
+        datagrams.emplace_back(NACK_MAGIC);
+        datagrams.back().push_back((char)VERSION);
+    }
+
+    /* the datagram an entry of len bytes goes to */
+    static std::string &room_for(std::vector<std::string> &datagrams, size_t len) {
+        if (datagrams.empty() || datagrams.back().size() + len > MAX_LEN)
+            start(datagrams);
+        return datagrams.back();
+    }
+
+public:
+    static bool is_nack(const uint8_t *data, size_t len) {
+        return len >= HEADER_LEN && memcmp(data, NACK_MAGIC, strlen(NACK_MAGIC)) == 0;
+    }
+
+    /* Packs ascending packet ids into as few datagrams as possible: long runs
+     * as ranges, everything else as bitmaps. */
+    static void encode(const std::vector<uint64_t> &ids, size_t psize, std::vector<std::string> &datagrams) {
+        size_t i = 0;
+        while (i < ids.size()) {
+            size_t run = 1;
+            while (i + run < ids.size() && ids[i + run] == ids[i] + run * psize)
+                ++run;
+
+            if (run >= MIN_RANGE) {
+                std::string &out = room_for(datagrams, RANGE_LEN);
+                out.push_back((char)RANGE);
+                put64(out, ids[i]);
+                put32(out, (uint32_t)run);
+                i += run;
+                continue;
+            }
+
+            /* a bitmap from ids[i] up to the next long run or the bitmap's reach */
+            uint64_t base = ids[i];
+            uint8_t bitmap[MAX_BITMAP_BYTES] = {0};
+            size_t bytes = 0;
+            while (i < ids.size() && (ids[i] - base) / psize < MAX_BITMAP_BYTES * 8) {
+                size_t ahead = 1;
+                while (ahead < MIN_RANGE && i + ahead < ids.size() && ids[i + ahead] == ids[i] + ahead * psize)
+                    ++ahead;
+                if (ahead == MIN_RANGE && ids[i] != base)
+                    break;
+
+                size_t bit = (ids[i] - base) / psize;
+                bitmap[bit / 8] |= (uint8_t)(1 << (bit % 8));
+                bytes = bit / 8 + 1;
+                ++i;
+            }
+
+            std::string &out = room_for(datagrams, BITMAP_HEADER_LEN + bytes);
+            out.push_back((char)BITMAP);
+            put64(out, base);
+            out.push_back((char)bytes);
+            out.append((const char *)bitmap, bytes);
+        }
+    }
+
+    /* Calls request(id) for every packet id asked for, at most max_ids of them.
+     * Returns 1 if the message is malformed or of an unknown version. */
+    template<typename F>
+    static int decode(const uint8_t *data, size_t len, size_t psize, size_t max_ids, F request) {
+        if (!is_nack(data, len) || data[HEADER_LEN - 1] != VERSION)
+            return 1;
+
+        size_t pos = HEADER_LEN, requested = 0;
+        while (pos < len) {
+            if (data[pos] == RANGE && pos + RANGE_LEN <= len) {
+                uint64_t first = get64(data + pos + 1);
+                uint32_t count = get32(data + pos + 9);
+                for (uint32_t i = 0; i < count && requested < max_ids; ++i, ++requested)
+                    request(first + i * psize);
+                pos += RANGE_LEN;
+            } else if (data[pos] == BITMAP && pos + BITMAP_HEADER_LEN <= len &&
+                       pos + BITMAP_HEADER_LEN + data[pos + 9] <= len) {
+                uint64_t base = get64(data + pos + 1);
+                size_t bytes = data[pos + 9];
+                const uint8_t *bitmap = data + pos + BITMAP_HEADER_LEN;
+                for (size_t bit = 0; bit < bytes * 8 && requested < max_ids; ++bit) {
+                    if (bitmap[bit / 8] & (1 << (bit % 8))) {
+                        request(base + bit * psize);
+                        ++requested;
+                    }
+                }
+                pos += BITMAP_HEADER_LEN + bytes;
+            } else {
+                return 1;
+            }
+        }
+        return 0;
+    }
+};
+
+/* LOUDER_PLEASE requests, for senders that take no binary ones: ids in
+ * network order as decimal numbers, separated by commas. */
+class text_nack {
+public:
+    static const size_t MAX_LEN = binary_nack::MAX_LEN;
+
+    /* splits the ids among messages that each fit in one datagram */
+    static void encode(const std::vector<uint64_t> &ids, std::vector<std::string> &datagrams) {
+        std::string msg;
+        for (uint64_t id : ids) {
+            std::string token = std::to_string(audiogram::htonll(id));
+            if (!msg.empty() && msg.size() + token.size() + 2 > MAX_LEN) {
+                datagrams.push_back(msg + "\n");
+                msg.clear();
+            }
+            msg.append(msg.empty() ? REXMIT_MSG : ",").append(token);
+        }
+        if (!msg.empty())
+            datagrams.push_back(msg + "\n");
+    }
+};
+
+/* Request of a receiver that just tuned in for the audiograms the station
+ * still holds from first_id on, count of them at most; the sender sends them
+ * to the receiver by unicast, so it need not fill its buffer with live audio
+ * before playing. After the magic and a version byte come the first id
+ * (8 bytes) and the count (4 bytes), in network order. */
+class catch_up_request {
+public:
+    static const uint8_t VERSION = 1;
+    static const size_t LEN = 16;
+
+    static std::string encode(uint64_t first_id, uint32_t count) {
+        std::string out(CATCH_UP_MAGIC);
+        out.push_back((char)VERSION);
+        first_id = audiogram::htonll(first_id);
+        out.append((const char *)&first_id, sizeof(first_id));
+        count = htonl(count);
+        out.append((const char *)&count, sizeof(count));
+        return out;
+    }
+
+    /* returns 1 if the message is not a catch-up request of a known version */
+    static int decode(const uint8_t *data, size_t len, uint64_t &first_id, uint32_t &count) {
+        if (len != LEN || memcmp(data, CATCH_UP_MAGIC, strlen(CATCH_UP_MAGIC)) != 0 ||
+            data[strlen(CATCH_UP_MAGIC)] != VERSION)
+            return 1;
+
+        memcpy(&first_id, data + 4, sizeof(first_id));
+        first_id = audiogram::ntohll(first_id);
+        memcpy(&count, data + 12, sizeof(count));
+        count = ntohl(count);
+        return 0;
+    }
+};
+
+
+#endif //RADIO_NACK_H
@@ -0,0 +1,161 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "audiogram.h"
+#include "nack.h"
+#include "const.h"
+
+
+/* Compares LOUDER_PLEASE and binary retransmission requests for a few loss
+ * patterns: bytes and datagrams on the wire, and the time to encode them on
+ * the receiver and decode them on the sender. Text is parsed as the sender's
+ * parse_rexmit does. Takes the number of rounds, 2000 by default. */
+class nack_compare {
+private:
+    static const size_t PSIZE = 512;
+    static const uint64_t FIRST_ID = (uint64_t)1000000 * PSIZE;
+
+    struct pattern {
+        const char *name;
+        std::vector<uint64_t> ids;
+    };
+
+    std::vector<pattern> patterns;
+    size_t rounds = 2000;
+
+    static std::vector<uint64_t> burst(size_t count) {
+        std::vector<uint64_t> ids;
+        for (size_t i = 0; i < count; ++i)
+            ids.push_back(FIRST_ID + i * PSIZE);
+        return ids;
+    }
+
+    static std::vector<uint64_t> every(size_t step, size_t span) {
+        std::vector<uint64_t> ids;
+        for (size_t i = 0; i < span; i += step)
+            ids.push_back(FIRST_ID + i * PSIZE);
+        return ids;
+    }
+
+    static std::vector<uint64_t> scattered(unsigned int percent, size_t span) {
+        std::minstd_rand rng(1);
+        std::vector<uint64_t> ids;
+        for (size_t i = 0; i < span; ++i) {
+            if (rng() % 100 < percent)
+                ids.push_back(FIRST_ID + i * PSIZE);
+        }
+        return ids;
+    }
+
+    static size_t parse_text(const std::string &datagram, std::vector<uint64_t> &results) {
+        char msg[MAX_UDP_MSG_LEN];
+        memcpy(msg, datagram.data(), datagram.size());
+        msg[datagram.size()] = '\0';
+        if (strstr(msg, REXMIT_MSG) != msg)
+            return 0;
+
+        strtok(msg, " ");
+        for (char *token = strtok(nullptr, ","); token != nullptr; token = strtok(nullptr, ",")) {
+            char *end = nullptr;
+            errno = 0;
+            unsigned long long value = strtoull(token, &end, 10);
+            if (token[0] != '-' && end != token && errno != ERANGE && (*end == '\0' || isspace((unsigned char)*end)))
+                results.push_back(audiogram::ntohll(value));
+        }
+        return results.size();
+    }
+
+    /* mean nanoseconds per round of f */
+    template<typename F>
+    double time(F f) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds; ++r)
+            f();
+        return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count() / rounds;
+    }
+
+    static size_t bytes_of(const std::vector<std::string> &datagrams) {
+        size_t bytes = 0;
+        for (const std::string &datagram : datagrams)
+            bytes += datagram.size();
+        return bytes;
+    }
+
+    void row(const char *name, const char *format, const std::vector<std::string> &datagrams,
+             double encode_ns, double decode_ns, size_t decoded, size_t expected) {
+        std::cout << std::left << std::setw(20) << name << std::setw(8) << format << std::right
+                  << std::setw(8) << bytes_of(datagrams) << std::setw(9) << datagrams.size()
+                  << std::setw(12) << std::fixed << std::setprecision(2) << encode_ns / 1000
+                  << std::setw(12) << decode_ns / 1000
+                  << (decoded == expected ? "" : "  decoded wrong") << "\n";
+    }
+
+public:
+    int init(int argc, char *argv[]) {
+        if (argc > 1)
+            rounds = strtoul(argv[1], nullptr, 10);
+        if (rounds == 0) {
+            std::cerr << "the argument ('" << argv[1] << "') for rounds is invalid\n";
+            return 1;
+        }
+
+        patterns.push_back({"single", burst(1)});
+        patterns.push_back({"burst of 64", burst(64)});
+        patterns.push_back({"burst of 1000", burst(1000)});
+        patterns.push_back({"every 10th of 4096", every(10, 4096)});
+        patterns.push_back({"5% of 4096", scattered(5, 4096)});
+        return 0;
+    }
+
+    void work() {
+        std::cout << std::left << std::setw(20) << "pattern" << std::setw(8) << "format" << std::right
+                  << std::setw(8) << "bytes" << std::setw(9) << "dgrams"
+                  << std::setw(12) << "encode us" << std::setw(12) << "decode us" << "\n";
+
+        for (const pattern &p : patterns) {
+            std::vector<std::string> text, binary;
+            std::vector<uint64_t> results;
+            size_t decoded = 0;
+
+            double encode_ns = time([&]() {
+                text.clear();
+                text_nack::encode(p.ids, text);
+            });
+            double decode_ns = time([&]() {
+                results.clear();
+                for (const std::string &datagram : text)
+                    parse_text(datagram, results);
+            });
+            row(p.name, "text", text, encode_ns, decode_ns, results.size(), p.ids.size());
+
+            encode_ns = time([&]() {
+                binary.clear();
+                binary_nack::encode(p.ids, PSIZE, binary);
+            });
+            decode_ns = time([&]() {
+                decoded = 0;
+                for (const std::string &datagram : binary)
+                    binary_nack::decode((const uint8_t *)datagram.data(), datagram.size(), PSIZE, SIZE_MAX,
+                                        [&](uint64_t) { ++decoded; });
+            });
+            row(p.name, "binary", binary, encode_ns, decode_ns, decoded, p.ids.size());
+        }
+    }
+};
+
+int main(int argc, char *argv[]) {
+    nack_compare c;
+    if (c.init(argc, argv)) return 1;
+    c.work();
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#ifndef RADIO_NACK_WHEEL_H
+#define RADIO_NACK_WHEEL_H
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <netinet/in.h>
+
+/* The receiver's retransmission requests still to make, one per missing
+ * audiogram of the station tuned in. A missing id has an entry at
+ * id / psize % slots saying when it is due, and waits in the bucket of that
+ * millisecond, due % buckets. Its arrival cancels it by clearing the entry,
+ * without a lock and without looking for it in its bucket; buckets drop
+ * cancelled ids when their time comes. Ids are scheduled and cancelled by the
+ * play thread and expire on the retransmission thread. */
+class nack_wheel {
+public:
+    /* where the requests go and how */
+    struct target {
+        struct sockaddr_in addr; // the station's group when shared
+        size_t psize;
+        bool binary;
+        bool shared;
+    };
+
+private:
+    struct entry {
+        std::atomic<uint64_t> id; // plus one, 0 if not pending
+        uint64_t due_ms;
+    };
+
+    std::unique_ptr<entry[]> entries;
+    size_t slots = 0;
+    std::vector<std::vector<uint64_t>> buckets;
+    std::vector<uint64_t> expiring;
+    uint64_t cursor_ms = 0; // buckets before it have expired
+    uint64_t wake_ms = UINT64_MAX; // when the retransmission thread wakes
+    target to = {};
+    std::mutex mut;
+    std::condition_variable scheduled;
+
+    entry &entry_of(uint64_t packet_id) {
+        return entries[packet_id / to.psize % slots];
+    }
+
+    static std::chrono::steady_clock::time_point deadline(uint64_t ms) {
+        return std::chrono::steady_clock::time_point(std::chrono::milliseconds(ms));
+    }
+
+    /* puts the id in its bucket; never behind the cursor, where it would wait a lap */
+    void at(uint64_t packet_id, entry &e, uint64_t due_ms) {
+        e.due_ms = std::max(due_ms, cursor_ms);
+        buckets[e.due_ms % buckets.size()].push_back(packet_id);
+        if (e.due_ms < wake_ms) {
+            wake_ms = e.due_ms;
+            scheduled.notify_one();
+        }
+    }
+
+    /* first millisecond from the cursor on whose bucket holds anything */
+    uint64_t next_due() const {
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            if (!buckets[(cursor_ms + i) % buckets.size()].empty())
+                return cursor_ms + i;
+        }
+        return UINT64_MAX;
+    }
+
+public:
+    /* room for the slots newest ids, due at most horizon_ms ahead */
+    void init(size_t slots, uint64_t horizon_ms) {
+        this->slots = slots;
+        entries = std::make_unique<entry[]>(slots);
+        for (size_t i = 0; i < slots; ++i)
+            entries[i].id.store(0, std::memory_order_relaxed);
+        buckets.assign(horizon_ms + 1, {});
+    }
+
+    /* forgets all requests, those to come go to the target given */
+    void reset(const target &target, uint64_t now_ms) {
+        std::lock_guard<std::mutex> lock(mut);
+        for (size_t i = 0; i < slots; ++i)
+            entries[i].id.store(0, std::memory_order_relaxed);
+        for (auto &bucket : buckets)
+            bucket.clear();
+        to = target;
+        cursor_ms = now_ms;
+    }
+
+    /* makes the ids from first to last due at due_ms; only the slots newest
+     * ones fit */
+    void schedule(uint64_t first, uint64_t last, uint64_t due_ms) {
+        std::lock_guard<std::mutex> lock(mut);
+        if (to.psize == 0 || first > last)
+            return;
+        if ((last - first) / to.psize >= slots)
+            first = last - (slots - 1) * to.psize;
+        for (uint64_t id = first; id <= last; id += to.psize) {
+            entry &e = entry_of(id);
+            e.id.store(id + 1, std::memory_order_relaxed);
+            at(id, e, due_ms);
+        }
+    }
+
+    /* the request for the id is not needed anymore, if one was pending */
+    void cancel(uint64_t packet_id, size_t packet_size) {
+        if (slots == 0)
+            return;
+        uint64_t pending = packet_id + 1;
+        entries[packet_id / packet_size % slots].id.compare_exchange_strong(pending, 0, std::memory_order_relaxed);
+    }
+
+    /* Calls repeat(id, target) for each id pending and due by now_ms, in
+     * order of their time. Those it returns true for are due again in rtime,
+     * the rest are dropped. Returns where the requests go. */
+    template <typename Repeat>
+    target expire(uint64_t now_ms, uint64_t rtime, Repeat repeat) {
+        std::lock_guard<std::mutex> lock(mut);
+        if (now_ms - std::min(now_ms, cursor_ms) >= buckets.size())
+            cursor_ms = now_ms - buckets.size() + 1;
+        for (; cursor_ms <= now_ms; ++cursor_ms) {
+            expiring.swap(buckets[cursor_ms % buckets.size()]);
+            for (uint64_t id : expiring) {
+                entry &e = entry_of(id);
+                if (e.id.load(std::memory_order_relaxed) != id + 1)
+                    continue;
+                /* ids due a lap later, or moved to another bucket, wait on */
+                if (e.due_ms > cursor_ms) {
+                    if (e.due_ms % buckets.size() == cursor_ms % buckets.size())
+                        buckets[cursor_ms % buckets.size()].push_back(id);
+                    continue;
+                }
+                if (repeat(id, to))
+                    at(id, e, now_ms + rtime);
+                else
+                    cancel(id, to.psize);
+            }
+            expiring.clear();
+        }
+        return to;
+    }
+
+    /* sleeps until the first request is due, one is scheduled before that, or until_ms */
+    void sleep_until(uint64_t until_ms) {
+        std::unique_lock<std::mutex> lock(mut);
+        wake_ms = std::min(until_ms, next_due());
+        while (std::chrono::steady_clock::now() < deadline(wake_ms))
+            scheduled.wait_until(lock, deadline(wake_ms));
+        wake_ms = UINT64_MAX;
+    }
+};
+
+
+#endif //RADIO_NACK_WHEEL_H
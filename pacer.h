@@ -0,0 +1,116 @@
+#ifndef RADIO_PACER_H
+#define RADIO_PACER_H
+
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+
+/* Token bucket on the monotonic clock. Tokens are bytes, refilled at rate
+ * bytes per second up to depth, so at most depth bytes leave back to back. */
+class pacer {
+public:
+    using clock = std::chrono::steady_clock;
+
+private:
+    double rate = 0; // 0 means unlimited
+    double depth = 0;
+    double tokens = 0;
+    clock::time_point last;
+
+    /* statistics */
+    clock::time_point start;
+    uint64_t bytes_total = 0;
+    uint64_t packets_total = 0;
+    uint64_t bursts = 0;
+    uint64_t cur_burst = 0;
+    uint64_t max_burst = 0;
+
+    void refill(clock::time_point now) {
+        tokens = std::min(depth, tokens + rate * std::chrono::duration<double>(now - last).count());
+        last = now;
+    }
+
+    void end_burst() {
+        if (cur_burst) {
+            ++bursts;
+            max_burst = std::max(max_burst, cur_burst);
+            cur_burst = 0;
+        }
+    }
+
+public:
+    void init(double rate, size_t depth) {
+        this->rate = rate;
+        this->depth = (double)depth;
+        tokens = this->depth;
+        last = start = clock::now();
+    }
+
+    /* changes the rate keeping the tokens collected so far */
+    void set_rate(double rate) {
+        refill(clock::now());
+        this->rate = rate;
+    }
+
+    bool enabled() const {
+        return rate > 0;
+    }
+
+    double get_rate() const {
+        return rate;
+    }
+
+    /* time left until size bytes may be sent, zero if they may go right away */
+    clock::duration delay(size_t size) {
+        if (!enabled())
+            return clock::duration::zero();
+
+        refill(clock::now());
+        if (tokens >= (double)size)
+            return clock::duration::zero();
+
+        return std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>(((double)size - tokens) / rate));
+    }
+
+    /* how many units of size bytes may be sent right away, most at most */
+    size_t allowance(size_t size, size_t most) {
+        if (!enabled())
+            return most;
+
+        refill(clock::now());
+        return tokens < (double)size ? 0 : std::min(most, (size_t)(tokens / (double)size));
+    }
+
+    void consume(size_t size) {
+        tokens -= (double)size;
+        bytes_total += size;
+        ++packets_total;
+        ++cur_burst;
+    }
+
+    /* called whenever the sender has to stop and wait, closes the current burst */
+    void pause() {
+        end_burst();
+    }
+
+    double achieved_rate() const {
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        return elapsed > 0 ? (double)bytes_total / elapsed : 0;
+    }
+
+    double mean_burst() {
+        return bursts ? (double)(packets_total - cur_burst) / (double)bursts : (double)cur_burst;
+    }
+
+    uint64_t get_max_burst() const {
+        return std::max(max_burst, cur_burst);
+    }
+
+    uint64_t get_bytes_total() const {
+        return bytes_total;
+    }
+};
+
+
+#endif //RADIO_PACER_H
@@ -0,0 +1,261 @@
+#ifndef RADIO_PACKET_RING_H
+#define RADIO_PACKET_RING_H
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <string>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FIFO_MAGIC "SIKFIFO"
+
+/* Memory for the FIFOs of all stations of a sender, one mapping cut into
+ * consecutive rings. With a backing file the arena survives restarts and
+ * rings found in it with matching geometry are resumed. */
+class ring_arena {
+private:
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    uint8_t *mapping = nullptr;
+    size_t map_len = 0;
+    bool persistent = false;
+
+    int map_file(const std::string &path, size_t len) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            std::cerr << "Error: open " << path << ", errno = " << errno << "\n";
+            return 1;
+        }
+
+        struct stat st;
+        bool same_size = fstat(fd, &st) == 0 && (size_t)st.st_size == len;
+        if (!same_size && ftruncate(fd, (off_t)len) < 0) {
+            std::cerr << "Error: ftruncate " << path << ", errno = " << errno << "\n";
+            close(fd);
+            return 1;
+        }
+
+        void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            std::cerr << "Error: fifo mmap " << path << ", errno = " << errno << "\n";
+            return 1;
+        }
+        mapping = (uint8_t *)mem;
+        map_len = len;
+        persistent = same_size;
+        return 0;
+    }
+
+public:
+    ~ring_arena() {
+        if (mapping != nullptr)
+            munmap(mapping, map_len);
+    }
+
+    /* returns 1 if len bytes cannot be mapped; with a non-empty path the
+     * arena lives in that file and survives restarts */
+    int init(size_t len, bool hugepages, const std::string &path = "") {
+        if (!path.empty())
+            return map_file(path, len);
+
+        void *mem = MAP_FAILED;
+        if (hugepages) {
+            size_t huge_len = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            mem = mmap(nullptr, huge_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem == MAP_FAILED)
+                std::cerr << "hugepages unavailable (errno = " << errno << "), using regular pages\n";
+            else
+                len = huge_len;
+        }
+        if (mem == MAP_FAILED) {
+            mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                std::cerr << "Error: fifo mmap, errno = " << errno << "\n";
+                return 1;
+            }
+            if (hugepages)
+                madvise(mem, len, MADV_HUGEPAGE);
+        }
+
+        mapping = (uint8_t *)mem;
+        map_len = len;
+        return 0;
+    }
+
+    /* true if the backing file held an arena of the same size */
+    bool is_persistent() const {
+        return persistent;
+    }
+
+    uint8_t *at(size_t offset) {
+        return mapping + offset;
+    }
+};
+
+/* The sender's FIFO: one preallocated slab cut into psize-long slots holding
+ * whole audiograms (header included). Packet ids grow by psize, so the slot of
+ * a packet is computed from its id and nothing is allocated after init.
+ * A single thread builds packets, any thread may look them up.
+ * The slab is preceded by a header page with the session and the ring state;
+ * when the ring is backed by a file, a restarted sender resumes from it. */
+class packet_ring {
+private:
+    static const size_t HEADER_LEN = 4096;
+
+    struct ring_header {
+        char magic[8];
+        uint64_t psize;
+        uint64_t slots;
+        uint64_t session_id;
+        uint64_t base_id;
+        uint64_t end_id;
+        uint64_t claim_id;
+    };
+
+    ring_header *header = nullptr;
+    uint8_t *slab = nullptr;
+    bool resumed = false;
+    size_t slots = 0;
+    size_t psize = 0;
+    uint64_t base_id = 0; // id of the first packet of the session
+    std::atomic<uint64_t> end_id; // one past the newest packet held, read by other threads
+    std::atomic<uint64_t> claim_id; // one past the packet being built, evicts the oldest one
+
+    uint8_t *slot(uint64_t packet_id) {
+        return slab + index_of(packet_id) * psize;
+    }
+
+public:
+    /* index of the slot a packet of the session goes to, held or not */
+    size_t index_of(uint64_t packet_id) const {
+        return (size_t)((packet_id - base_id) / psize % slots);
+    }
+
+    /* bytes of arena taken by a ring, kept page aligned */
+    static size_t footprint(size_t slots, size_t psize) {
+        return HEADER_LEN + (slots * psize + HEADER_LEN - 1) / HEADER_LEN * HEADER_LEN;
+    }
+
+    /* places the ring at mem, footprint() bytes long; with resume set, takes
+     * over the state left there by a previous run made with the same geometry */
+    void attach(uint8_t *mem, size_t slots, size_t psize, bool resume) {
+        this->slots = slots;
+        this->psize = psize;
+        header = (ring_header *)mem;
+        slab = mem + HEADER_LEN;
+
+        resumed = resume && memcmp(header->magic, FIFO_MAGIC, sizeof(header->magic)) == 0 &&
+                  header->psize == psize && header->slots == slots;
+        if (resumed) {
+            base_id = header->base_id;
+            end_id.store(header->end_id);
+            claim_id.store(header->claim_id);
+        } else {
+            memcpy(header->magic, FIFO_MAGIC, sizeof(header->magic));
+            header->psize = psize;
+            header->slots = slots;
+            start_session(0, 0);
+        }
+    }
+
+    /* forgets all packets, the next one built will be first_id */
+    void start_session(uint64_t session_id, uint64_t first_id) {
+        header->session_id = session_id;
+        header->base_id = base_id = first_id;
+        header->end_id = first_id;
+        header->claim_id = first_id;
+        end_id.store(first_id);
+        claim_id.store(first_id);
+    }
+
+    /* true if the state of a previous run was found in the backing file */
+    bool is_resumed() const {
+        return resumed;
+    }
+
+    uint64_t get_session_id() const {
+        return header->session_id;
+    }
+
+    size_t capacity() const {
+        return slots;
+    }
+
+    /* slot to build the packet following the newest one in, reusing the oldest slot when full */
+    uint8_t *reserve(uint64_t packet_id) {
+        /* readers copying the evicted packet have to see the claim before any new byte */
+        claim_id.store(packet_id + psize, std::memory_order_relaxed);
+        header->claim_id = packet_id + psize;
+        std::atomic_thread_fence(std::memory_order_release);
+        return slot(packet_id);
+    }
+
+    /* makes the packet built in its reserved slot available to find(),
+     * sequentially consistent for stage_signal */
+    void commit(uint64_t packet_id) {
+        end_id.store(packet_id + psize);
+        header->end_id = packet_id + psize;
+    }
+
+    /* index of the slot holding the packet, -1 if it is no longer (or not yet) held;
+     * safe to call from any thread */
+    long slot_of(uint64_t packet_id) const {
+        uint64_t end = end_id.load(std::memory_order_acquire);
+        uint64_t claim = claim_id.load(std::memory_order_acquire);
+        if (packet_id < base_id || packet_id >= end || (packet_id - base_id) % psize != 0)
+            return -1;
+        if ((claim - packet_id) / psize > slots)
+            return -1;
+        return (long)((packet_id - base_id) / psize % slots);
+    }
+
+    /* the stored audiogram, nullptr if the packet is no longer (or not yet) held */
+    uint8_t *find(uint64_t packet_id) {
+        long index = slot_of(packet_id);
+        return index < 0 ? nullptr : at((size_t)index);
+    }
+
+    uint8_t *at(size_t index) {
+        return slab + index * psize;
+    }
+
+    /* copies a packet out of the ring while its slot may be reused concurrently,
+     * returns 1 if the packet is not held or got evicted during the copy */
+    int copy_out(uint64_t packet_id, uint8_t *dst) {
+        long index = slot_of(packet_id);
+        if (index < 0)
+            return 1;
+
+        memcpy(dst, at((size_t)index), psize);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot_of(packet_id) < 0;
+    }
+
+    uint64_t get_end_id() const {
+        return end_id.load(std::memory_order_acquire);
+    }
+
+    /* id of the oldest packet held, end id if there is none */
+    uint64_t oldest_id() const {
+        uint64_t end = end_id.load(std::memory_order_acquire);
+        uint64_t held = (end - base_id) / psize;
+        return end - std::min(held, (uint64_t)slots) * psize;
+    }
+
+    /* slot of the oldest packet held */
+    size_t oldest_slot() const {
+        uint64_t held = (end_id.load(std::memory_order_acquire) - base_id) / psize;
+        return held > slots ? held % slots : 0;
+    }
+};
+
+
+#endif //RADIO_PACKET_RING_H
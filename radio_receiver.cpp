@@ -7,16 +7,32 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <ctime>
 #include <chrono>
 #include <thread>
 #include <mutex>
 #include <list>
-#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <atomic>
-#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <random>
+#include <algorithm>
 #include "boost/program_options.hpp"
 #include "audiogram.h"
+#include "fec.h"
+#include "nack.h"
+#include "codec.h"
+#include "silence.h"
+#include "metrics.h"
+#include "jitter_buffer.h"
+#include "nack_wheel.h"
 #include "receiver.h"
 #include "transmitter.h"
 #include "const.h"
@@ -29,23 +45,27 @@ protected:
         struct sockaddr_in direct;
         std::string name;
         time_t last_answ;
-    };
-
-    struct rexmit_data {
-        uint64_t min;
-        uint64_t max;
-        size_t psize;
-        struct sockaddr_in direct;
+        bool binary_nack; // takes binary retransmission requests
+        bool nack_group; // takes requests sent to its group, where receivers hear each other
+        unsigned int codec_channels; // audio is IMA-ADPCM of that many channels, 0 if raw
+        bool catch_up; // sends receivers that tune in the audio it holds
     };
 
     static const uint32_t DEFAULT_DISCOVER_ADDR = (uint32_t)-1;
     static const time_t DISCONNECT_INTERVAL = 20; // in seconds
     static const int LOOKUP_INTERVAL = 5; // in seconds
+    static const int REPORT_INTERVAL = 10; // in seconds
 
     /* current station data */
     struct sockaddr_in direct_addr;
+    bool direct_binary = false;
+    bool direct_shared = false; // requests go to the group, see peer_nack_rcv
+    bool direct_catch_up = false;
+    struct sockaddr_in nack_group_addr = {0};
     std::string station_name;
     struct sockaddr_in mcast_addr = {0};
+    unsigned int codec_channels = 0;
+    std::vector<uint8_t> pcm_out; // decoded audio of the audiograms written at once
 
     struct sockaddr_in discover_addr;
     in_port_t ctrl_port = (in_port_t)35826;
@@ -53,25 +73,85 @@ protected:
     size_t bsize = 65536;
     size_t psize;
     unsigned long rtime = 250;
+    unsigned long nack_backoff = 50; // ms, upper bound of the random delay of requests to the group
 
     std::map<std::string, std::list<struct station_det>> stations;
-    std::vector<audiogram> audio_buf;
-    unsigned long out_id = 0;
+    jitter_buffer audio_buf;
+    /* Audiograms are received in batches, each straight into the slot the
+     * next ones in order take. Those that cannot go there, or turn out to
+     * belong elsewhere, land in stray first. */
+    static const size_t RECV_BATCH = 16;
+    std::vector<uint8_t> stray;
+    std::vector<uint8_t> silent_packet; // a zeroed audiogram standing for a silent one
+    uint64_t recv_calls = 0;
+    uint64_t audiograms_received = 0;
+    uint64_t received_in_place = 0;
+    uint64_t out_index = 0; // of the next audiogram to play, counted from byte_zero
+    /* Runs of audiograms ready to play are written with one call, straight
+     * from the buffer. Into a pipe they go with vmsplice, which leaves the
+     * pipe referring to the slab until they are read: the slots written last,
+     * at most one per pipe buffer, are then kept out of the window, and the
+     * slab is not reused after tuning in before the pipe is drained. */
+    static const size_t OUT_BATCH = 64;
+    bool out_pipe = false;
+    size_t out_pipe_size = 0;
+    size_t splice_lag = 0; // slots the pipe may still refer to, 0 if not splicing
+    size_t out_offset = 0; // bytes of the audiogram at out_index already written, of its PCM if coded
+    uint64_t out_calls = 0;
     receiver lookup_tr_reply_rcv; // bound, receives from the same address it sends
     transmitter rexmit_tr;
     transmitter direct_tr;
     receiver mcast_rcv;
+    receiver fec_rcv; // parity of the current station, on its data port + 1
+    receiver silence_rcv; // silence markers of the current station
+    static const size_t MAX_WAITING_PARITY = 4;
+    std::vector<uint8_t> parity_buf;
+    /* parity that came before the end of its block */
+    std::vector<std::vector<uint8_t>> waiting_parity;
+    uint64_t parity_received = 0;
+    uint64_t fec_recovered = 0;
+    time_t next_fec_report = 0;
+    /* ids of the audiograms held in the buffer, plus one, by id / psize;
+     * lets the retransmission thread skip what has arrived in the meantime */
+    std::unique_ptr<std::atomic<uint64_t>[]> arrived;
+    size_t arrived_len = 0;
+    std::atomic<uint64_t> fec_horizon; // end of the newest block whose parity came
+    std::atomic<uint64_t> last_parity_ms;
+    /* Requests of other receivers of the current station, heard on its group
+     * when the station takes requests there. A receiver delays its own
+     * requests by a random backoff and holds back those another receiver made
+     * within rtime, so a loss shared by many receivers is requested about once.
+     * Used by the retransmission thread only, like peer_requests. */
+    receiver peer_nack_rcv;
+    in_port_t own_nack_port = 0;
+    /* ids requested by peers, plus one, and when (ms), by id / psize */
+    std::vector<std::pair<uint64_t, uint64_t>> peer_requests;
+    std::minstd_rand backoff_rng;
+    uint64_t ids_requested = 0;
+    uint64_t ids_held_back = 0;
+    time_t next_nack_report = 0;
     std::mutex current_mut;
     std::mutex direct_mut;
     std::mutex new_station_mut;
     std::mutex stations_mut;
     std::mutex name_mut;
     std::atomic<uint64_t> last_id_written;
-    std::atomic_flag keep_waiting = ATOMIC_FLAG_INIT;
-    std::atomic_flag keep_playing = ATOMIC_FLAG_INIT;
+    /* The play thread sleeps in play_epoll on the current station's sockets,
+     * on stdout once it plays, on station_changed, written on every station
+     * change, and on report_timer. */
+    enum play_tag : uint64_t {STATION_TAG, REPORT_TAG, DATA_TAG, PARITY_TAG, SILENCE_TAG, OUT_TAG};
+    int play_epoll = -1;
+    int station_changed = -1;
+    int report_timer = -1;
+    bool out_pollable = true; // false if stdout is a regular file, always writable
+    latency_histogram wake_to_output; // from the wakeup to the audiogram written, by the play thread
+    uint64_t play_wakeups = 0;
+    uint64_t audiograms_written = 0;
     std::atomic_flag unchanged_list = ATOMIC_FLAG_INIT;
-    std::vector<std::mutex> rexmit_batch_mut;
-    std::vector<std::unordered_map<std::string, std::list<rexmit_data>>> rexmit_batch;
+    /* requests for the missing audiograms of the current station, cancelled
+     * as they arrive and repeated every rtime while they can still be played */
+    nack_wheel rexmits;
+    std::vector<uint64_t> rexmit_ids; // used by the retransmission thread only
 
 public:
     int init(int argc, char *argv[]) {
@@ -87,7 +167,8 @@ public:
                 (",U", po::value<in_port_t>(&ui_port), "ui_port")
                 (",b", po::value<size_t>(&bsize), "bsize")
                 (",n", po::value<std::string>(&station_name), "name")
-                (",r", po::value<unsigned long>(&rtime), "rtime");
+                (",r", po::value<unsigned long>(&rtime), "rtime")
+                (",k", po::value<unsigned long>(&nack_backoff), "nack backoff");
 
         po::variables_map vm;
         try {
@@ -121,15 +202,32 @@ public:
         }
 
         last_id_written = 0;
-        rexmit_batch_mut = std::vector<std::mutex>(rtime);
-        rexmit_batch =
-                std::vector<std::unordered_map<std::string, std::list<rexmit_data>>>(rtime);
+        if (audio_buf.init(bsize, audiogram::HEADER_SIZE + 1)) {
+            std::cerr << "Error: jitter buffer allocation, errno = " << errno << "\n";
+            return 1;
+        }
+        struct stat out_stat;
+        out_pipe = fstat(STDOUT_FILENO, &out_stat) == 0 && S_ISFIFO(out_stat.st_mode);
+        /* the pipe's room is known in bytes, it fills by pages: a write must
+         * not wait for the rest, which goes on the next EPOLLOUT */
+        if (out_pipe && fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK) < 0)
+            std::cerr << "Error: output fcntl, errno = " << errno << "\n";
+        parity_buf = std::vector<uint8_t>(MAX_UDP_MSG_LEN);
+        waiting_parity.reserve(MAX_WAITING_PARITY);
+        arrived_len = bsize / (audiogram::HEADER_SIZE + 1) + 1;
+        arrived = std::make_unique<std::atomic<uint64_t>[]>(arrived_len);
+        clear_arrived();
+        fec_horizon = 0;
+        last_parity_ms = 0;
+        peer_requests = std::vector<std::pair<uint64_t, uint64_t>>(arrived_len, {0, 0});
+        backoff_rng.seed(std::random_device()());
+        rexmits.init(arrived_len, rtime + nack_backoff);
         lookup_tr_reply_rcv.prepare_to_receive();
         fcntl(lookup_tr_reply_rcv.sock, F_SETFL, O_NONBLOCK);
         rexmit_tr.prepare_to_send();
         direct_tr.prepare_to_send_nonblock();
-        keep_waiting.test_and_set();
-        keep_playing.test_and_set();
+        if (prepare_play())
+            return 1;
         unchanged_list.test_and_set();
 
         return 0;
@@ -170,13 +268,19 @@ protected:
     void receive_replies() {
         int started_playing = 0;
         time_t start = time(nullptr);
+        struct pollfd reply = {lookup_tr_reply_rcv.sock, POLLIN, 0};
 
         while (true) {
             do {
+                /* the socket does not block, so the loop sleeps here between replies */
+                if (poll(&reply, 1, -1) <= 0)
+                    continue;
                 sockaddr_in addr, direct;
                 std::string name;
+                bool binary_nack = false, nack_group = false, catch_up = false;
+                unsigned int codec = 0;
 
-                if (!receive_reply(addr, direct, name)) {
+                if (!receive_reply(addr, direct, name, binary_nack, nack_group, codec, catch_up)) {
                     std::cerr << "received reply\n";
                     if (!started_playing) {
                         if (station_name.empty()) {
@@ -192,7 +296,8 @@ protected:
                     std::cerr << "bef st mut replies" << "\n";
                     stations_mut.lock(); std::cerr << "in st mut replies" << "\n";
                     station_det del_station = {0};
-                    if (handle_stations_update(addr, direct, name, &del_station)) {
+                    if (handle_stations_update(addr, direct, name, binary_nack, nack_group, codec, catch_up,
+                                               &del_station)) {
                         name_mut.lock();
                         if (del_station.name == station_name) {
                             name_mut.unlock();
@@ -221,7 +326,6 @@ protected:
                 if (now - std::prev(li)->last_answ > DISCONNECT_INTERVAL) {
                     std::cerr << "deleting (name " << mi->first << " addr " << inet_ntoa(std::prev(li)->addr.sin_addr) << " port " << ntohs(std::prev(li)->addr.sin_port) << ")\n";
                     del_station = *(std::prev(li));
-                    clean_rexmits(del_station.name);
                     mi->second.erase(std::prev(li));
                 }
             }
@@ -241,24 +345,26 @@ protected:
         stations_mut.unlock();std::cerr << "out del inact" << "\n";
     }
 
-    void clean_rexmits(std::string &name) {
-        for (long i = rtime - 1; i >= 0; --i) {
-            rexmit_batch_mut[i].lock();
-            rexmit_batch[i].erase(name);
-            rexmit_batch_mut[i].unlock();
-        }
-    }
-
     void set_new_station(struct station_det &station) {
         new_station_mut.lock();
         std::cerr << "in 1 mutex\n";
-        keep_playing.clear();
-        keep_waiting.clear();
+        uint64_t change = 1;
+        if (write(station_changed, &change, sizeof(change)) != sizeof(change))
+            std::cerr << "Error: station change write, errno = " << errno << "\n";
 
         current_mut.lock();std::cerr << "in 2 mutex\n";
         mcast_rcv.drop_mcast();
+        fec_rcv.drop_mcast();
+        silence_rcv.drop_mcast();
         mcast_addr = station.addr;
+        codec_channels = station.codec_channels;
         mcast_rcv.prepare_to_receive_mcast(station.addr);
+        sockaddr_in parity_addr = station.addr;
+        parity_addr.sin_port = htons((in_port_t)(ntohs(station.addr.sin_port) + 1));
+        fec_rcv.prepare_to_receive_mcast(parity_addr);
+        sockaddr_in silence_addr = station.addr;
+        silence_addr.sin_port = htons((in_port_t)(ntohs(station.addr.sin_port) + silence_marker::PORT_OFFSET));
+        silence_rcv.prepare_to_receive_mcast(silence_addr);
 
         name_mut.lock();
         station_name = station.name;
@@ -266,6 +372,16 @@ protected:
 
         direct_mut.lock();
         direct_addr = station.direct;
+        direct_binary = station.binary_nack;
+        direct_catch_up = station.catch_up;
+        peer_nack_rcv.drop_mcast();
+        peer_nack_rcv.sock = -1;
+        direct_shared = false;
+        if (station.nack_group) {
+            nack_group_addr = station.addr;
+            nack_group_addr.sin_port = htons((in_port_t)(ntohs(station.addr.sin_port) + NACK_GROUP_PORT_OFFSET));
+            direct_shared = !peer_nack_rcv.prepare_to_receive_group(nack_group_addr);
+        }
         direct_mut.unlock();
 
         current_mut.unlock();std::cerr << "out 1 mutex\n";
@@ -280,7 +396,8 @@ protected:
 
     /* returns 1 if station list changes, 0 otherwise */
     int handle_stations_update(sockaddr_in &addr, sockaddr_in &direct,
-                               std::string &name, station_det *del_station) {std::cerr << "handle in" << "\n";
+                               std::string &name, bool binary_nack, bool nack_group,
+                               unsigned int codec, bool catch_up, station_det *del_station) {std::cerr << "handle in" << "\n";
         time_t now = time(nullptr);
         if (stations.count(name)) {
             for (auto li = stations[name].begin(); li != stations[name].end(); ++li) {
@@ -298,38 +415,44 @@ protected:
                         sd.last_answ = now;
                         sd.direct = direct;
                         sd.name = name;
+                        sd.binary_nack = binary_nack;
+                        sd.nack_group = nack_group;
+                        sd.codec_channels = codec;
+                        sd.catch_up = catch_up;
                         std::cerr << "upd station " << name << "\n";
                         return 0;
                     }
                 }
             }
         } else {
-            struct station_det sd = {addr, direct, name, now};
+            struct station_det sd = {addr, direct, name, now, binary_nack, nack_group, codec, catch_up};
             stations[name].push_back(sd);
             std::cerr << "add station " << name << inet_ntoa(addr.sin_addr) << " " << ntohs(addr.sin_port) << " direct " << inet_ntoa(direct.sin_addr) << " " << ntohs(direct.sin_port) << "\n";
             return 1;
         }
     }
 
-    int receive_reply(sockaddr_in &addr, sockaddr_in &direct, std::string &name) {
+    int receive_reply(sockaddr_in &addr, sockaddr_in &direct, std::string &name,
+                      bool &binary_nack, bool &nack_group, unsigned int &codec, bool &catch_up) {
         char buffer[MAX_CTRL_MSG_LEN];
         // sockaddr_in rcv_addr;
         socklen_t rcv_addr_len = (socklen_t)sizeof(direct);
         ssize_t rcv_len = recvfrom(lookup_tr_reply_rcv.sock, (void *)&buffer,
-                sizeof(buffer), 0, (struct sockaddr *)&direct, &rcv_addr_len);
+                sizeof(buffer) - 1, 0, (struct sockaddr *)&direct, &rcv_addr_len);
 
         if (rcv_len > 0) {
             // printf("read %zd bytes: %.*s\n", rcv_len, (int) rcv_len, buffer);
             int err = 0;
             buffer[rcv_len] = '\0';
 
-            return parse_reply(buffer, addr, name);
+            return parse_reply(buffer, addr, name, binary_nack, nack_group, codec, catch_up);
         }
 
         return 1;
     }
 
-    int parse_reply(char *reply_str, sockaddr_in &addr, std::string &name) {
+    int parse_reply(char *reply_str, sockaddr_in &addr, std::string &name,
+                    bool &binary_nack, bool &nack_group, unsigned int &codec, bool &catch_up) {
         int err = 0;
         strtok(reply_str, " ");
         char *token = strtok(nullptr, " ");
@@ -361,230 +484,752 @@ protected:
             {name = std::string(token); std::cerr << "rpl name: " << name << "\n";}
         }
 
+        /* lines after the first one announce extensions */
+        std::string nack_ext(NACK_REPLY_EXT, strlen(NACK_REPLY_EXT) - 1);
+        std::string group_ext(NACK_GROUP_EXT, strlen(NACK_GROUP_EXT) - 1);
+        std::string catch_up_ext(CATCH_UP_REPLY_EXT, strlen(CATCH_UP_REPLY_EXT) - 1);
+        while (!err && (token = strtok(nullptr, "\n")) != nullptr) {
+            if (nack_ext == token)
+                binary_nack = true;
+            else if (group_ext == token)
+                nack_group = true;
+            else if (catch_up_ext == token)
+                catch_up = true;
+            else if (strncmp(token, "+codec=", strlen("+codec=")) == 0)
+                /* audio this receiver cannot decode is not worth listing */
+                err = (codec = ima_adpcm::parse_reply_line(token)) == 0;
+        }
+        /* coded audio is not where the first line says */
+        if (!err && codec > 0) {
+            if (ntohs(addr.sin_port) > 65535 - CODEC_PORT_OFFSET)
+                err = 1;
+            else
+                addr.sin_port = htons((in_port_t)(ntohs(addr.sin_port) + CODEC_PORT_OFFSET));
+        }
+
         return err;
     }
 
+    int prepare_play() {
+        play_epoll = epoll_create1(0);
+        station_changed = eventfd(0, EFD_NONBLOCK);
+        report_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (play_epoll < 0 || station_changed < 0 || report_timer < 0) {
+            std::cerr << "Error: play epoll, errno = " << errno << "\n";
+            return 1;
+        }
+
+        struct itimerspec every = {{REPORT_INTERVAL, 0}, {REPORT_INTERVAL, 0}};
+        if (timerfd_settime(report_timer, 0, &every, nullptr) < 0 ||
+            watch(station_changed, EPOLLIN, STATION_TAG) || watch(report_timer, EPOLLIN, REPORT_TAG)) {
+            std::cerr << "Error: play epoll_ctl, errno = " << errno << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    int watch(int fd, uint32_t events, uint64_t tag) {
+        struct epoll_event ev = {0};
+        ev.events = events;
+        ev.data.u64 = tag;
+        return epoll_ctl(play_epoll, EPOLL_CTL_ADD, fd, &ev) < 0;
+    }
+
+    void unwatch(int fd) {
+        struct epoll_event ev = {0};
+        epoll_ctl(play_epoll, EPOLL_CTL_DEL, fd, &ev);
+    }
+
+    /* stdout is watched only while playing, as it is writable nearly always;
+     * epoll does not take regular files, which never block anyway */
+    void watch_output() {
+        if (out_pollable && watch(STDOUT_FILENO, EPOLLOUT, OUT_TAG)) {
+            if (errno != EPERM)
+                std::cerr << "Error: stdout epoll_ctl, errno = " << errno << "\n";
+            out_pollable = false;
+        }
+    }
+
+    static void drain(int fd) {
+        uint64_t value;
+        while (read(fd, &value, sizeof(value)) == sizeof(value)) {
+        }
+    }
+
+    void report_play() {
+        if (play_wakeups > 0)
+            std::cerr << "play: " << play_wakeups << " wakeups, " << audiograms_written
+                      << " audiograms written, wakeup to output under " << wake_to_output.quantile_bound_us(0.5)
+                      << " us for half of them, under " << wake_to_output.quantile_bound_us(0.99)
+                      << " us for 99%\n";
+        if (out_calls > 0)
+            std::cerr << "output: " << audiograms_written << " audiograms in " << out_calls
+                      << (splice_lag > 0 ? " vmsplice calls\n" : " write calls\n");
+        if (recv_calls > 0)
+            std::cerr << "receive: " << audiograms_received << " audiograms in " << recv_calls << " recvmmsg calls, "
+                      << received_in_place << " straight into their slots\n";
+    }
+
+    /* Plays the current station until it changes or playing has to start
+     * again. Sleeps in epoll between packets and stdout becoming writable;
+     * a station change wakes it through station_changed. */
     int play() {
-        while (keep_waiting.test_and_set()) {
+        /* nothing to play before the first station is chosen */
+        struct pollfd first_station = {station_changed, POLLIN, 0};
+        while (poll(&first_station, 1, -1) <= 0) {
         }
 
+        static const int MAX_EVENTS = 8;
+        struct epoll_event events[MAX_EVENTS];
         int initialized = 0, play = 0, end = 0;
-        char buffer[MAX_UDP_MSG_LEN];
         uint64_t session_id, byte_zero;
         uint64_t max_id_read;
-        struct pollfd polled[2];
-        polled[0].fd = STDOUT_FILENO;
-        polled[0].events = POLLOUT;
-        polled[1].events = POLLIN;
+        uint64_t catch_up_end = 0; // first live audiogram while a catch-up burst comes, 0 if none
 
         while (true) {
             initialized = 0;
             play = 0;
             end = 0;
             last_id_written = 0;
-            audiogram a(0, true);
+            /* nothing of the station left is worth asking for anymore */
+            rexmits.reset({}, now_ms());
 
             new_station_mut.lock();std::cerr<<"in newstmut\n";
             new_station_mut.unlock();std::cerr<<"after newstmut\n";
             current_mut.lock();std::cerr<<"in mcastmut\n";
 
-            polled[1].fd = mcast_rcv.sock;
+            /* the change that brought us here was written before current_mut was taken */
+            drain(station_changed);
+            int socks[3] = {mcast_rcv.sock, fec_rcv.sock, silence_rcv.sock};
+            if (watch(socks[0], EPOLLIN, DATA_TAG))
+                std::cerr << "Error: play epoll_ctl, errno = " << errno << "\n";
 
             while (!end) {
-                if (!keep_playing.test_and_set()) {
-                    break;
+                int timeout = play && !out_pollable ? 0 : -1;
+                int n = epoll_wait(play_epoll, events, MAX_EVENTS, timeout);
+                if (n < 0) {
+                    if (errno != EINTR)
+                        std::cerr << "Error: play epoll_wait, errno = " << errno << "\n";
+                    continue;
+                }
+                std::chrono::steady_clock::time_point woken = std::chrono::steady_clock::now();
+                ++play_wakeups;
+
+                bool data_ready = false, parity_ready = false, silence_ready = false;
+                bool out_ready = play && !out_pollable;
+                for (int i = 0; i < n; ++i) {
+                    switch (events[i].data.u64) {
+                    case STATION_TAG:
+                        end = true;
+                        break;
+                    case REPORT_TAG:
+                        drain(report_timer);
+                        report_play();
+                        break;
+                    case DATA_TAG:
+                        data_ready = true;
+                        break;
+                    case PARITY_TAG:
+                        parity_ready = true;
+                        break;
+                    case SILENCE_TAG:
+                        silence_ready = true;
+                        break;
+                    case OUT_TAG:
+                        out_ready = true;
+                        break;
+                    }
                 }
+                if (end)
+                    break;
 
                 if (!initialized) {
-                    if (!uninitialized_recv(buffer, a)) {
-                        session_id = a.get_session_id();
-                        byte_zero = a.get_packet_id();
-                        max_id_read = byte_zero;
-                        audio_buf[0] = a;
-                        out_id = 0;
+                    uint8_t header[audiogram::HEADER_SIZE];
+                    if (data_ready && !uninitialized_recv(header)) {
+                        session_id = audiogram::session_id_of(header);
+                        max_id_read = audiogram::packet_id_of(header);
+                        /* slots before the first live audiogram wait for the burst */
+                        size_t behind = request_catch_up(max_id_read);
+                        byte_zero = max_id_read - behind * psize;
+                        catch_up_end = behind > 0 ? max_id_read : 0;
+                        if (recv(mcast_rcv.sock, (void *)audio_buf.slot(behind), psize, 0) < 0)
+                            std::cerr << "Error: receiver recv, errno = " << errno << "\n";
+                        audio_buf.set_fresh(behind);
+                        out_index = 0;
+                        clear_arrived();
+                        reset_rexmits();
+                        mark_arrived(max_id_read);
+                        waiting_parity.clear();
                         initialized = 1;
+                        /* parity and markers are of use once the first audiogram came */
+                        if (watch(socks[1], EPOLLIN, PARITY_TAG) || watch(socks[2], EPOLLIN, SILENCE_TAG))
+                            std::cerr << "Error: play epoll_ctl, errno = " << errno << "\n";
                     }
                     continue;
                 }
 
                 if (!play) {
-                    ssize_t rcv_len = read(mcast_rcv.sock, (void *)a.get_packet_data(), psize);
-                    if (rcv_len < 0) {
-                        continue;
-                    }//std::cerr<<"rcv ok";
-                    if (handle_new_audiogram(session_id, byte_zero, max_id_read, a)) {
+                    if (parity_ready)
+                        receive_parity(session_id, byte_zero, max_id_read);
+                    if (silence_ready && receive_silence(session_id, byte_zero, max_id_read))
                         break;
-                    }//std::cerr << "not play aft handle";
-                    if (a.get_packet_id() >=
-                        byte_zero + psize * audio_buf.capacity() * 3 / 4) {
+                    if (data_ready) {
+                        if (receive_audiograms(session_id, byte_zero, max_id_read)) {
+                            break;
+                        }//std::cerr << "not play aft handle";
+                        retry_parity(session_id, byte_zero, max_id_read);
+                    }
+                    /* silence fills the buffer as well as audio does; a complete
+                     * burst fills it at once */
+                    if (max_id_read >= byte_zero + psize * audio_buf.capacity() * 3 / 4 ||
+                        (catch_up_end > 0 && has_arrived(catch_up_end - psize, psize))) {
+                        if (catch_up_end > 0)
+                            start_after_catch_up(byte_zero, catch_up_end);
                         play = 1;
+                        watch_output();
                     }//std::cerr << "bytezero" << byte_zero << " capacity " << audio_buf.capacity() << " pcktid " << a.get_packet_id() << " < " << byte_zero + psize * audio_buf.capacity() * 3 / 4<< "\n";
                 } else {
-                    polled[0].revents = 0;
-                    polled[1].revents = 0;
-
-                    int poll_num = poll(polled, 2, 0);
-                    switch (poll_num) {
-                    case 0:
+                    if (parity_ready)
+                        receive_parity(session_id, byte_zero, max_id_read);
+                    /* markers go out before the audiograms after the silence */
+                    if (silence_ready && receive_silence(session_id, byte_zero, max_id_read)) {
+                        end = true;
                         continue;
-                    case 1:
-                    case 2:
-                        if (polled[0].revents & POLLOUT) {
-                            if (!audio_buf[out_id].is_fresh()) {std::cerr<<"REASON2";
-                                end = true;
-                                continue;
-                            }
-                            std::cout.write((char *)audio_buf[out_id].get_audio_data(),
-                                            psize - audiogram::HEADER_SIZE);
-                            audio_buf[out_id].set_fresh(false);
-                            //std::cout.flush(); // keep deleted
-                            last_id_written = audio_buf[out_id].get_packet_id();
-                            out_id = (out_id + 1) % audio_buf.capacity();
+                    }
+                    if (out_ready) {
+                        if (!audio_buf.is_fresh(out_index % audio_buf.capacity())) {std::cerr<<"REASON2";
+                            end = true;
+                            continue;
                         }
-                        if (polled[1].revents & POLLIN) {
-                            a.set_size(psize);
-                            ssize_t rcv_len = read(mcast_rcv.sock, (void *)a.get_packet_data(), psize);
-                            if (rcv_len < 0) {
-                                std::cerr << "Error: receiver read, errno = " << errno << "\n";
-                                continue;
-                            }
-
-                            if (handle_new_audiogram(session_id, byte_zero, max_id_read, a)) {
-                                end = true;
-                                break;
-                            }
+                        write_ready_run();
+                        wake_to_output.record(std::chrono::steady_clock::now() - woken);
+                    }
+                    if (data_ready) {
+                        if (receive_audiograms(session_id, byte_zero, max_id_read)) {
+                            end = true;
+                            break;
                         }
-                    //default: // < 0
-                        //std::cerr << "Error: rcv poll " << errno << "\n";
+                        retry_parity(session_id, byte_zero, max_id_read);
                     }
                 }
             }
+            for (int sock : socks)
+                unwatch(sock);
+            if (play && out_pollable)
+                unwatch(STDOUT_FILENO);
             current_mut.unlock();
         }
     }
 
-    /* returns 1 if playing needs to be started again, 0 otherwise */
+    /* Takes up to RECV_BATCH audiograms with one recvmmsg. Returns 1 if
+     * playing needs to be started again, 0 otherwise. */
+    int receive_audiograms(uint64_t session_id, uint64_t byte_zero, uint64_t &max_id_read) {
+        struct mmsghdr msgs[RECV_BATCH];
+        struct iovec iov[RECV_BATCH];
+        uint8_t *landing[RECV_BATCH];
+
+        /* a slot is landed in only if nothing there waits to be played */
+        bool in_place = true;
+        for (size_t k = 0; k < RECV_BATCH; ++k) {
+            uint64_t index = (max_id_read + (k + 1) * psize - byte_zero) / psize;
+            size_t slot = index % audio_buf.capacity();
+            in_place = in_place && index < window_end() && !audio_buf.is_fresh(slot);
+            landing[k] = in_place ? audio_buf.slot(slot) : stray.data() + k * psize;
+            iov[k].iov_base = landing[k];
+            iov[k].iov_len = psize;
+            memset(&msgs[k].msg_hdr, 0, sizeof(msgs[k].msg_hdr));
+            msgs[k].msg_hdr.msg_iov = &iov[k];
+            msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(mcast_rcv.sock, msgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                std::cerr << "Error: receiver recvmmsg, errno = " << errno << "\n";
+            return 0;
+        }
+        ++recv_calls;
+        audiograms_received += n;
+
+        /* whatever landed in a slot it does not belong to moves out of it
+         * before any audiogram is placed, so none is overwritten unread */
+        for (int k = 0; k < n; ++k) {
+            uint8_t *own_stray = stray.data() + k * psize;
+            if (landing[k] == own_stray)
+                continue;
+            if (msgs[k].msg_len == psize && audiogram::packet_id_of(landing[k]) == max_id_read + (k + 1) * psize) {
+                ++received_in_place;
+                continue;
+            }
+            memcpy(own_stray, landing[k], msgs[k].msg_len);
+            audiogram::set_header(landing[k], 0, jitter_buffer::NO_PACKET);
+            landing[k] = own_stray;
+        }
+
+        for (int k = 0; k < n; ++k) {
+            if (msgs[k].msg_len != psize || (msgs[k].msg_hdr.msg_flags & MSG_TRUNC))
+                continue;
+            if (handle_new_audiogram(session_id, byte_zero, max_id_read, landing[k]))
+                return 1;
+        }
+        return 0;
+    }
+
+    /* Puts the audiogram in its slot unless it is already there. Returns 1 if
+     * playing needs to be started again, 0 otherwise. */
     int handle_new_audiogram(uint64_t session_id, uint64_t byte_zero,
-                             uint64_t &max_id_read, audiogram &a) {//std::cerr<<"innewaudg ";
-        if (session_id > a.get_session_id())
+                             uint64_t &max_id_read, const uint8_t *packet) {//std::cerr<<"innewaudg ";
+        if (session_id > audiogram::session_id_of(packet))
             return 1;
 
-        uint64_t packet_id = a.get_packet_id();
-        if (packet_id <= byte_zero)
+        uint64_t packet_id = audiogram::packet_id_of(packet);
+        if (packet_id < byte_zero || (packet_id == byte_zero && holds(byte_zero, packet_id)))
             return 0;
         if (((packet_id - byte_zero) % psize) != 0)
             return 0;
-        unsigned long buf_id = (packet_id - byte_zero) / psize;
-        if (buf_id >= audio_buf.capacity() + out_id) { std::cerr<<"REASON1";
+        uint64_t index = (packet_id - byte_zero) / psize;
+        /* played already, its slot may hold one a lap newer; repairs made
+         * for other receivers come late like that */
+        if (index < out_index)
+            return 0;
+        if (index >= window_end()) { std::cerr<<"REASON1";
             return 1;
         }
-        buf_id = ((packet_id - byte_zero) / psize) % audio_buf.capacity();
+        size_t buf_id = index % audio_buf.capacity();
 
         if (packet_id > max_id_read + psize) {
-            for (unsigned long i = (max_id_read / psize) % audio_buf.capacity() + 1; // max index
-                    i < buf_id; ++i)
-                audio_buf[i].set_fresh(false);
+            /* the slots skipped may still hold audiograms played a lap ago */
+            uint64_t first_gap = (max_id_read - byte_zero) / psize + 1;
+            audio_buf.clear_fresh(first_gap % audio_buf.capacity(), index - first_gap);
             add_rexmit(max_id_read + psize, packet_id - psize);
         }
         if (packet_id >= max_id_read + psize)
             max_id_read = packet_id;
 
-        a.set_fresh(true);
-        audio_buf[buf_id] = a;
+        uint8_t *slot = audio_buf.slot(buf_id);
+        if (slot != packet)
+            memcpy(slot, packet, psize);
+        audio_buf.set_fresh(buf_id);
+        mark_arrived(packet_id);
 
         return 0;
     }
 
+    /* Asks the current station, if it takes such requests, for the half of
+     * the buffer before the first live audiogram. Returns the number of
+     * audiograms asked for, 0 if none. */
+    size_t request_catch_up(uint64_t first_live) {
+        direct_mut.lock();
+        bool supported = direct_catch_up;
+        struct sockaddr_in to = direct_addr;
+        direct_mut.unlock();
+
+        size_t behind = std::min(audio_buf.capacity() / 2, (size_t)(first_live / psize));
+        if (!supported || behind == 0)
+            return 0;
+        std::string msg = catch_up_request::encode(first_live - behind * psize, (uint32_t)behind);
+        if (sendto(direct_tr.sock, (void *)msg.data(), msg.size(), 0, (struct sockaddr *)&to, sizeof(to)) == -1) {
+            std::cerr << "Error: catch-up sendto, errno = " << errno << "\n";
+            return 0;
+        }
+        return behind;
+    }
+
+    /* Starts playing at the oldest audiogram of the burst that came, and asks
+     * for the ones missing after it like for any other loss. */
+    void start_after_catch_up(uint64_t byte_zero, uint64_t catch_up_end) {
+        /* nothing is played yet, so the slots holding audiograms are the fresh ones */
+        size_t end = (catch_up_end - byte_zero) / psize;
+        out_index = audio_buf.stale_run(0, end);
+        std::cerr << "catch-up: playing from " << end - out_index << " audiograms back\n";
+
+        for (size_t i = out_index; i < end;) {
+            i += audio_buf.fresh_run(i, end - i);
+            size_t missing = audio_buf.stale_run(i, end - i);
+            if (missing > 0)
+                add_rexmit(byte_zero + i * psize, byte_zero + (i + missing - 1) * psize);
+            i += missing;
+        }
+    }
+
+    /* index of the first audiogram whose slot is still taken */
+    uint64_t window_end() const {
+        return audio_buf.capacity() + (out_index > splice_lag ? out_index - splice_lag : 0);
+    }
+
+    /* Writes the audiograms ready to play from out_index on with one call,
+     * the audio of IMA-ADPCM decoded first, no more than the pipe takes. An
+     * audiogram is done with once it is written whole; a write may stop
+     * within one, the rest goes when stdout is writable again. */
+    void write_ready_run() {
+        size_t capacity = audio_buf.capacity();
+        size_t payload = psize - audiogram::HEADER_SIZE;
+        size_t run = audio_buf.fresh_run(out_index % capacity, std::min(capacity, (size_t)OUT_BATCH));
+        ++out_calls;
+
+        /* copies into a pipe block once it is full, so they take no more than
+         * fits, and at least one audiogram */
+        size_t out_size = codec_channels > 0 ? ima_adpcm::pcm_size(payload, codec_channels) : payload;
+        if (splice_lag == 0)
+            run = std::max((size_t)1, std::min(run, pipe_room() / out_size));
+
+        if (codec_channels > 0) {
+            size_t pcm_size = out_size;
+            pcm_out.resize(run * pcm_size);
+            for (size_t k = 0; k < run; ++k)
+                ima_adpcm::decode(audio_buf.slot((out_index + k) % capacity) + audiogram::HEADER_SIZE, payload,
+                                  codec_channels, pcm_out.data() + k * pcm_size);
+            size_t len = std::min(pcm_out.size() - out_offset, pipe_room());
+            if (len == 0)
+                return;
+            ssize_t written = write(STDOUT_FILENO, pcm_out.data() + out_offset, len);
+            if (written < 0) {
+                if (errno != EAGAIN && errno != EINTR)
+                    std::cerr << "Error: output write, errno = " << errno << "\n";
+                return;
+            }
+            size_t bytes = out_offset + (size_t)written;
+            played(bytes / pcm_size);
+            out_offset = bytes % pcm_size;
+            return;
+        }
+
+        struct iovec iov[OUT_BATCH];
+        for (size_t k = 0; k < run; ++k) {
+            size_t skip = k == 0 ? out_offset : 0;
+            iov[k].iov_base = audio_buf.slot((out_index + k) % capacity) + audiogram::HEADER_SIZE + skip;
+            iov[k].iov_len = payload - skip;
+        }
+        ssize_t written = splice_lag > 0 ? vmsplice(STDOUT_FILENO, iov, run, SPLICE_F_NONBLOCK)
+                                         : writev(STDOUT_FILENO, iov, (int)run);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                std::cerr << "Error: output write, errno = " << errno << "\n";
+            return;
+        }
+        size_t bytes = out_offset + (size_t)written;
+        played(bytes / payload);
+        out_offset = bytes % payload;
+    }
+
+    /* bytes stdout takes without blocking, as far as is known */
+    size_t pipe_room() {
+        int queued = 0;
+        if (!out_pipe || ioctl(STDOUT_FILENO, FIONREAD, &queued) < 0)
+            return SIZE_MAX;
+        return out_pipe_size > (size_t)queued ? out_pipe_size - queued : 0;
+    }
+
+    void played(size_t count) {
+        if (count == 0)
+            return;
+        size_t capacity = audio_buf.capacity();
+        audio_buf.clear_fresh(out_index % capacity, count);
+        last_id_written = audiogram::packet_id_of(audio_buf.slot((out_index + count - 1) % capacity));
+        out_index += count;
+        audiograms_written += count;
+    }
+
+    /* Splices into a pipe when it holds few enough slots for the buffer to
+     * spare them, after waiting for what it took from the slab before to be
+     * read. A reader that does not drain it within a second is given copies
+     * from then on. */
+    void prepare_output() {
+        if (splice_lag > 0) {
+            int queued = 0;
+            for (int waited = 0; waited < 1000 && ioctl(STDOUT_FILENO, FIONREAD, &queued) == 0 && queued > 0;
+                 ++waited)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (queued > 0) {
+                std::cerr << "output: pipe not drained, writing copies from now on\n";
+                out_pipe = false;
+            }
+        }
+
+        splice_lag = 0;
+        out_offset = 0;
+        long page = sysconf(_SC_PAGESIZE);
+        int pipe_size = out_pipe ? fcntl(STDOUT_FILENO, F_GETPIPE_SZ) : -1;
+        out_pipe_size = pipe_size > 0 ? (size_t)pipe_size : 0;
+        if (codec_channels == 0 && pipe_size > 0 && page > 0 &&
+            (size_t)(pipe_size / page) * 4 <= audio_buf.capacity())
+            splice_lag = (size_t)(pipe_size / page);
+    }
+
+    void clear_arrived() {
+        for (size_t i = 0; i < arrived_len; ++i)
+            arrived[i].store(0, std::memory_order_relaxed);
+    }
+
+    void mark_arrived(uint64_t packet_id) {
+        arrived[packet_id / psize % arrived_len].store(packet_id + 1, std::memory_order_release);
+        rexmits.cancel(packet_id, psize);
+    }
+
+    bool has_arrived(uint64_t packet_id, size_t packet_size) {
+        return arrived[packet_id / packet_size % arrived_len].load(std::memory_order_acquire) == packet_id + 1;
+    }
+
+    static uint64_t now_ms() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /* true if audiogram is still in its buffer slot, played or not */
+    bool holds(uint64_t byte_zero, uint64_t packet_id) {
+        return audio_buf.holds(((packet_id - byte_zero) / psize) % audio_buf.capacity(), packet_id);
+    }
+
+    /* Reads a parity packet, if one came, and uses it or keeps it until its
+     * whole block had a chance to arrive. */
+    void receive_parity(uint64_t session_id, uint64_t byte_zero, uint64_t &max_id_read) {
+        ssize_t rcv_len = read(fec_rcv.sock, (void *)parity_buf.data(), parity_buf.size());
+        if (rcv_len < 0)
+            return;
+
+        uint64_t parity_session, first_id;
+        size_t block;
+        if (parity_block::parse(parity_buf.data(), (size_t)rcv_len, psize, parity_session, first_id, block) ||
+            parity_session != session_id)
+            return;
+        ++parity_received;
+        fec_horizon = first_id + block * psize;
+        last_parity_ms = now_ms();
+        report_fec();
+
+        if (use_parity(parity_buf.data(), session_id, byte_zero, max_id_read)) {
+            if (waiting_parity.size() == MAX_WAITING_PARITY)
+                waiting_parity.erase(waiting_parity.begin());
+            waiting_parity.emplace_back(parity_buf.begin(), parity_buf.begin() + rcv_len);
+        }
+    }
+
+    /* Fills the run of silent audiograms a marker stands for with zeroed ones,
+     * as if they came. Returns 1 if playing needs to be started again. */
+    int receive_silence(uint64_t session_id, uint64_t byte_zero, uint64_t &max_id_read) {
+        uint8_t marker[silence_marker::SIZE + 1];
+        ssize_t rcv_len = read(silence_rcv.sock, (void *)marker, sizeof(marker));
+        uint64_t marker_session, first_id, last_id;
+        if (rcv_len < 0 || silence_marker::parse(marker, (size_t)rcv_len, marker_session, first_id, last_id) ||
+            marker_session != session_id)
+            return 0;
+
+        /* late markers may not refill slots already played out */
+        for (uint64_t id = std::max(first_id, last_id_written.load() + psize); id <= last_id; id += psize) {
+            audiogram::set_header(silent_packet.data(), session_id, id);
+            if (handle_new_audiogram(session_id, byte_zero, max_id_read, silent_packet.data()))
+                return 1;
+        }
+        return 0;
+    }
+
+    void retry_parity(uint64_t session_id, uint64_t byte_zero, uint64_t &max_id_read) {
+        for (auto it = waiting_parity.begin(); it != waiting_parity.end();) {
+            if (use_parity(it->data(), session_id, byte_zero, max_id_read))
+                ++it;
+            else
+                it = waiting_parity.erase(it);
+        }
+    }
+
+    /* Rebuilds the audiogram of a parity block if exactly that one is missing.
+     * The slot of the rebuilt audiogram must not have been played yet nor hold
+     * anything newer. Returns 1 if the block may still be completed by
+     * audiograms to come, 0 if the parity is of no more use. */
+    int use_parity(const uint8_t *parity, uint64_t session_id, uint64_t byte_zero, uint64_t &max_id_read) {
+        uint64_t first_id = audiogram::packet_id_of(parity), block_value;
+        memcpy(&block_value, parity + audiogram::HEADER_SIZE, sizeof(block_value));
+        size_t block = (size_t)audiogram::ntohll(block_value);
+        if (first_id < byte_zero || (first_id - byte_zero) % psize != 0 || block > audio_buf.capacity())
+            return 0;
+
+        uint64_t missing = 0;
+        size_t missing_count = 0;
+        for (size_t i = 0; i < block && missing_count < 2; ++i) {
+            uint64_t packet_id = first_id + i * psize;
+            if (!holds(byte_zero, packet_id)) {
+                missing = packet_id;
+                ++missing_count;
+            }
+        }
+        if (missing_count > 1)
+            return first_id + (block - 1) * psize > max_id_read;
+        if (missing_count == 0 || missing <= last_id_written || (missing - byte_zero) / psize >= window_end())
+            return 0;
+
+        size_t index = ((missing - byte_zero) / psize) % audio_buf.capacity();
+        uint8_t *slot = audio_buf.slot(index);
+        uint64_t held = audiogram::packet_id_of(slot);
+        if (held != jitter_buffer::NO_PACKET && held > missing)
+            return 0;
+
+        size_t len = psize - audiogram::HEADER_SIZE;
+        audiogram::set_header(slot, session_id, missing);
+        memcpy(slot + audiogram::HEADER_SIZE, parity_block::payload_of(parity), len);
+        for (size_t i = 0; i < block; ++i) {
+            uint64_t packet_id = first_id + i * psize;
+            if (packet_id != missing)
+                parity_block::xor_into(slot + audiogram::HEADER_SIZE, audiogram::HEADER_SIZE +
+                        audio_buf.slot(((packet_id - byte_zero) / psize) % audio_buf.capacity()), len);
+        }
+        audio_buf.set_fresh(index);
+        mark_arrived(missing);
+        if (missing > max_id_read)
+            max_id_read = missing;
+        ++fec_recovered;
+        return 0;
+    }
+
+    void report_fec() {
+        time_t now = time(nullptr);
+        if (now < next_fec_report)
+            return;
+        std::cerr << "fec: " << parity_received << " parity audiograms received, "
+                  << fec_recovered << " audiograms rebuilt\n";
+        next_fec_report = now + REPORT_INTERVAL;
+    }
+
+    /* requests of the station tuned in go where its current details say */
+    void reset_rexmits() {
+        direct_mut.lock();
+        nack_wheel::target to = {direct_shared ? nack_group_addr : direct_addr, psize, direct_binary, direct_shared};
+        direct_mut.unlock();
+        rexmits.reset(to, now_ms());
+    }
+
     void add_rexmit(uint64_t min, uint64_t max) {
-        if (min <= max) {//std::cerr << "min " << min << " max " << max << "\n";
-            struct timeval moment;
-            gettimeofday(&moment, nullptr);
-            int batch = (int)((moment.tv_sec * 1000 + moment.tv_usec / 1000) % rtime);
-            rexmit_batch_mut[batch].lock();
-//            for (uint64_t i = min; i <= max; i += psize) {
+        if (min <= max) {
             std::cerr << "ADDREXMIT " << min << " " << max << "\n";
-            rexmit_batch[batch][station_name].push_back({min, max, psize, direct_addr});
-                //std::cerr << "rexmit add to list " << i << " -> " << inet_ntoa(direct_addr.sin_addr) << "\n";
-//            }
-            rexmit_batch_mut[batch].unlock();
+            uint64_t due = now_ms();
+            if (direct_shared && nack_backoff > 0)
+                due += backoff_rng() % nack_backoff;
+            rexmits.schedule(min, max, due);
         }
     }
 
+    /* Makes the requests due, then sleeps until the next ones are, or a
+     * while at most, to take in other receivers' requests and report. */
     void send_rexmits() {
+        std::vector<std::string> datagrams;
         while (true) {
-            for (int i = 0; i < rtime; ++i) {
-                name_mut.lock();
-                std::string name = station_name;
-                name_mut.unlock();
-                rexmit_batch_mut[i].lock();
-
-                for (auto mi = rexmit_batch[i].begin();
-                        mi != rexmit_batch[i].end();) {
-                    std::string msg(REXMIT_MSG);
-                    for (auto li = mi->second.begin();
-                            li != mi->second.end();) {
-                        ++li;
-                        build_rexmit(msg, mi->first, name, li, mi);
-                    }
-
-                    auto old_mi = mi;
-                    ++mi;
-                    if (msg.size() > strlen(REXMIT_MSG)) {
-                        msg.append("\n");
-                        std::cerr << msg;
-                        std::cerr << "send to " << inet_ntoa(old_mi->second.front().direct.sin_addr) << " " << ntohs(old_mi->second.front().direct.sin_port) << "\n";
-                        sendto(direct_tr.sock, (void *) msg.c_str(), msg.size(),
-                               0, (struct sockaddr *) &old_mi->second.front().direct,
-                               sizeof(old_mi->second.front().direct));
-                    } else {
-                        rexmit_batch[i].erase(old_mi->first);
-                    }
+            direct_mut.lock();
+            receive_peer_nacks();
+            direct_mut.unlock();
+
+            uint64_t now = now_ms();
+            /* while parity comes, packets of blocks whose parity is still due wait for it */
+            uint64_t horizon = now - last_parity_ms < rtime ? fec_horizon.load() : UINT64_MAX;
+            /* packets already played out are not worth asking for */
+            uint64_t played = last_id_written.load();
+            rexmit_ids.clear();
+            nack_wheel::target to = rexmits.expire(now, rtime, [&](uint64_t id, const nack_wheel::target &to) {
+                if (id <= played)
+                    return false;
+                if (id >= horizon)
+                    return true;
+                if (to.shared && peer_requested(id, to.psize, now)) {
+                    ++ids_held_back;
+                    return true;
                 }
-                rexmit_batch_mut[i].unlock();
+                rexmit_ids.push_back(id);
+                return true;
+            });
+
+            if (!rexmit_ids.empty()) {
+                std::cerr << "send to " << inet_ntoa(to.addr.sin_addr) << " " << ntohs(to.addr.sin_port) << "\n";
+                std::sort(rexmit_ids.begin(), rexmit_ids.end());
+                rexmit_ids.erase(std::unique(rexmit_ids.begin(), rexmit_ids.end()), rexmit_ids.end());
+                datagrams.clear();
+                if (to.binary)
+                    binary_nack::encode(rexmit_ids, to.psize, datagrams);
+                else
+                    text_nack::encode(rexmit_ids, datagrams);
+                for (auto &datagram : datagrams)
+                    sendto(direct_tr.sock, (void *) datagram.data(), datagram.size(),
+                           0, (struct sockaddr *) &to.addr, sizeof(to.addr));
+                ids_requested += rexmit_ids.size();
             }
+            report_nacks();
+            rexmits.sleep_until(now_ms() + rtime);
         }
     }
 
-    void build_rexmit(std::string &msg, const std::string &to_station_name,
-        std::string &cur_station_name, std::list<rexmit_data>::iterator &li,
-        std::unordered_map<std::string, std::list<rexmit_data>>::iterator &mi) {
-        rexmit_data &rd = *std::prev(li);
+    /* takes in what other receivers requested on the current station's group */
+    void receive_peer_nacks() {
+        char buffer[binary_nack::MAX_LEN + 1];
+        size_t packet_size = psize;
+
+        if (peer_nack_rcv.sock < 0 || packet_size == 0)
+            return;
+        if (own_nack_port == 0) {
+            struct sockaddr_in own;
+            socklen_t own_len = (socklen_t)sizeof(own);
+            if (getsockname(direct_tr.sock, (struct sockaddr *)&own, &own_len) == 0)
+                own_nack_port = own.sin_port;
+        }
 
-//        if (to_station_name == cur_station_name) {
-//            uint64_t circa_last_id_written = last_id_written;
-//            uint64_t i;
-////            for (i = rd.min; i <= circa_last_id_written;
-////                    i += rd.psize) {
-////
-//////                if (i > rd.max) {std::cerr << "EMPTIED\n";
-//////                    mi->second.erase(std::prev(li));
-//////                    return;
-//////                }
-////            }
-//            rd.min = i;
-//        }
+        while (true) {
+            struct sockaddr_in rcv_addr;
+            socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
+            ssize_t rcv_len = recvfrom(peer_nack_rcv.sock, (void *)buffer, sizeof(buffer) - 1,
+                                       0, (struct sockaddr *)&rcv_addr, &rcv_addr_len);
+            if (rcv_len < 0)
+                return;
+            /* our own requests come back through multicast loopback */
+            if (rcv_addr.sin_port == own_nack_port)
+                continue;
+
+            uint64_t now = now_ms();
+            auto heard = [&](uint64_t id) {
+                peer_requests[id / packet_size % peer_requests.size()] = {id + 1, now};
+            };
+            buffer[rcv_len] = '\0';
+            if (strncmp(buffer, REXMIT_MSG, strlen(REXMIT_MSG)) == 0) {
+                char *save = nullptr;
+                for (char *token = strtok_r(buffer + strlen(REXMIT_MSG), ",\n", &save); token != nullptr;
+                     token = strtok_r(nullptr, ",\n", &save))
+                    heard(audiogram::ntohll(strtoull(token, nullptr, 10)));
+            } else if (binary_nack::is_nack((uint8_t *)buffer, (size_t)rcv_len)) {
+                binary_nack::decode((uint8_t *)buffer, (size_t)rcv_len, packet_size, peer_requests.size(), heard);
+            }
+        }
+    }
 
-        for (uint64_t i = rd.min; i <= rd.max; i += rd.psize) {
-            msg.append(std::to_string(audiogram::htonll(i)));
+    bool peer_requested(uint64_t packet_id, size_t packet_size, uint64_t now) {
+        const std::pair<uint64_t, uint64_t> &entry = peer_requests[packet_id / packet_size % peer_requests.size()];
+        return entry.first == packet_id + 1 && now - entry.second < rtime;
+    }
 
-            if (i != rd.max || li != mi->second.end())
-                msg.append(",");
-        }
+    void report_nacks() {
+        time_t now = time(nullptr);
+        if (now < next_nack_report)
+            return;
+        if (ids_requested > 0 || ids_held_back > 0)
+            std::cerr << "requests: " << ids_requested << " audiograms requested, "
+                      << ids_held_back << " held back for other receivers' requests\n";
+        next_nack_report = now + REPORT_INTERVAL;
     }
 
-    int uninitialized_recv(char *buffer, audiogram &a) {
-        ssize_t rcv_len = read(mcast_rcv.sock, (void *)buffer, MAX_UDP_MSG_LEN);
-        if (rcv_len < 0) {
+    /* Peeks at the first audiogram of a station, which tells the packet size,
+     * and cuts the buffer for it. The audiogram stays queued, to be received
+     * straight into its slot. */
+    int uninitialized_recv(uint8_t *header) {
+        ssize_t rcv_len = recv(mcast_rcv.sock, (void *)header, audiogram::HEADER_SIZE, MSG_PEEK | MSG_TRUNC);
+        if (rcv_len < 0)
+            return 1;
+        if (rcv_len <= audiogram::HEADER_SIZE || (size_t)rcv_len > bsize) {
+            recv(mcast_rcv.sock, (void *)header, audiogram::HEADER_SIZE, 0);
             return 1;
-        } else {
-            psize = (size_t) rcv_len;
-            audio_buf = std::vector<audiogram>(bsize / psize, audiogram(0, false));
-            a.set_size(psize);
-            a.set_session_id(*(uint64_t *)buffer);
-            a.set_packet_id(*(uint64_t *)(buffer + sizeof(uint64_t)));
-            memcpy(a.get_packet_data(), buffer, psize);
-            return 0;
         }
+
+        psize = (size_t)rcv_len;
+        /* only headers, which are never written out, change before the pipe is drained */
+        audio_buf.reset(psize);
+        prepare_output();
+        /* both only grow, so tuning in again to the same station allocates nothing */
+        stray.resize(RECV_BATCH * psize);
+        silent_packet.assign(psize, 0);
+        return 0;
     }
 };
 
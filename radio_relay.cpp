@@ -0,0 +1,620 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "boost/program_options.hpp"
+#include "audiogram.h"
+#include "audio_batch.h"
+#include "codec.h"
+#include "silence.h"
+#include "nack.h"
+#include "repair_cache.h"
+#include "lookup_filter.h"
+#include "receiver.h"
+#include "transmitter.h"
+#include "const.h"
+
+
+/* Relays one station into another network segment. Its audiograms, parity
+ * and silence markers are forwarded to a group of the segment as they come,
+ * unchanged, so receivers there see the station's own session and ids. The
+ * relay answers the segment's lookups and serves its retransmission requests
+ * from a repair_cache; only packets the relay lost itself go back to the
+ * station as requests, once for the whole segment. Runs on one thread. */
+class radio_relay {
+private:
+    static const uint32_t DEFAULT_DISCOVER_ADDR = (uint32_t)-1;
+    static const int LOOKUP_INTERVAL = 5; // in seconds
+    static const int REPORT_INTERVAL = 10; // in seconds
+    static const size_t BATCH_SIZE = 32;
+    static const uint64_t LOOKUP_TAG = 0;
+    static const uint64_t DATA_TAG = 1;
+    static const uint64_t PARITY_TAG = 2;
+    static const uint64_t SILENCE_TAG = 3;
+    static const uint64_t CTRL_TAG = 4;
+
+    /* the station relayed */
+    std::string station_name; // the first one to reply if empty
+    struct sockaddr_in discover_addr = {0};
+    struct sockaddr_in up_addr = {0}; // its group and data port, no port until it replied
+    struct sockaddr_in up_direct = {0}; // where requests for it go
+    bool up_binary = false;
+    std::string codec_line; // passed on, receivers of the segment decode the audio themselves
+
+    /* the segment */
+    std::string mcast_addr_dotted;
+    in_port_t down_port = 0; // host order, the data port its replies name
+    struct sockaddr_in down_addr = {0};
+    struct sockaddr_in down_parity_addr = {0};
+    struct sockaddr_in down_silence_addr = {0};
+    in_port_t ctrl_port = (in_port_t)35826;
+    std::string reply_msg; // empty until the station is found
+    size_t fsize = 128 * 1000 * 1000; // bytes of audiograms kept for repairs
+    std::chrono::milliseconds rtime = std::chrono::milliseconds(250);
+
+    receiver lookup_rcv; // lookups and requests to the station go out here, its replies come back
+    receiver data_rcv;
+    receiver parity_rcv;
+    receiver silence_rcv;
+    int ctrl_sock = -1; // lookups and requests of the segment
+    transmitter down_tr;
+    int epoll_fd = -1;
+
+    repair_cache cache;
+    audio_batch forward_batch; // packets stay in the cache until flushed
+    audio_batch repair_batch;
+    uint64_t session_id = 0;
+    bool started = false; // an audiogram of the session came
+    std::vector<uint8_t> silent; // zeroed audiogram standing for a silent one
+    std::vector<uint64_t> missing; // ids to ask the station for once per rtime
+    std::vector<uint64_t> last_repaired; // id plus one last repaired, by slot
+    std::vector<uint64_t> last_repaired_ms;
+    lookup_filter reply_filter;
+
+    uint64_t forwarded = 0;
+    uint64_t silent_filled = 0;
+    uint64_t repairs_served = 0;
+    uint64_t requests_passed = 0; // asked for by the segment, not held by the relay
+    uint64_t ids_requested = 0;
+
+public:
+    ~radio_relay() {
+        close(ctrl_sock);
+        close(epoll_fd);
+    }
+
+    int init(int argc, char *argv[]) {
+        namespace po = boost::program_options;
+        std::string discover, iface;
+        in_port_t data_port = 25826, up_ctrl_port = 35826;
+        int time = 250;
+
+        po::options_description desc("Options");
+        desc.add_options()
+                (",d", po::value<std::string>(&discover), "discover_addr")
+                (",C", po::value<in_port_t>(&up_ctrl_port), "ctrl_port of the station")
+                (",n", po::value<std::string>(&station_name), "name")
+                (",a", po::value<std::string>(&mcast_addr_dotted), "mcast_addr of the segment")
+                (",P", po::value<in_port_t>(&data_port), "data_port of the segment")
+                (",c", po::value<in_port_t>(&ctrl_port), "ctrl_port of the segment")
+                (",I", po::value<std::string>(&iface), "interface address of the segment")
+                (",f", po::value<size_t>(&fsize), "fsize")
+                (",r", po::value<int>(&time), "rtime");
+
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            po::notify(vm);
+        } catch (po::error &e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+
+        if (mcast_addr_dotted.empty()) {
+            std::cerr << "the option '-a' is required but missing\n";
+            return 1;
+        }
+        if (!inet_pton(AF_INET, mcast_addr_dotted.c_str(), &down_addr.sin_addr)) {
+            std::cerr << "the argument ('" << mcast_addr_dotted << "') for option '-a' is invalid\n";
+            return 1;
+        }
+        if (data_port == 0 || data_port > 65535 - silence_marker::PORT_OFFSET) {
+            std::cerr << "the argument ('" << data_port << "') for option '--P' is invalid\n";
+            return 1;
+        }
+        if (ctrl_port == 0 || up_ctrl_port == 0) {
+            std::cerr << "the argument ('0') for option '--" << (ctrl_port == 0 ? "c" : "C") << "' is invalid\n";
+            return 1;
+        }
+        if (fsize == 0) {
+            std::cerr << "the argument ('0') for option '--f' is invalid\n";
+            return 1;
+        }
+        if (time <= 0) {
+            std::cerr << "the argument ('" << time << "') for option '--r' is invalid\n";
+            return 1;
+        }
+        rtime = std::chrono::milliseconds(time);
+
+        discover_addr.sin_family = AF_INET;
+        discover_addr.sin_port = htons(up_ctrl_port);
+        discover_addr.sin_addr.s_addr = htonl(DEFAULT_DISCOVER_ADDR);
+        if (!discover.empty() && !inet_pton(AF_INET, discover.c_str(), &discover_addr.sin_addr)) {
+            std::cerr << "the argument ('" << discover << "') for option '-d' is invalid\n";
+            return 1;
+        }
+
+        down_addr.sin_family = AF_INET;
+        down_port = data_port;
+        place_down(data_port);
+        ctrl_port = htons(ctrl_port);
+
+        down_tr.prepare_to_send();
+        if (!iface.empty()) {
+            struct in_addr local;
+            if (!inet_pton(AF_INET, iface.c_str(), &local)) {
+                std::cerr << "the argument ('" << iface << "') for option '-I' is invalid\n";
+                return 1;
+            }
+            if (setsockopt(down_tr.sock, IPPROTO_IP, IP_MULTICAST_IF, (void *)&local, sizeof(local)) < 0) {
+                std::cerr << "Error: setsockopt multicast if, errno = " << errno << "\n";
+                return 1;
+            }
+        }
+        reply_filter.init(4096, 1000);
+
+        return prepare_control();
+    }
+
+    void work() {
+        static const int MAX_EVENTS = 8;
+        struct epoll_event events[MAX_EVENTS];
+        uint64_t next_lookup = now_ms(), next_request = now_ms() + rtime.count();
+        uint64_t next_report = now_ms() + REPORT_INTERVAL * 1000;
+
+        while (true) {
+            uint64_t now = now_ms();
+            if (now >= next_lookup) {
+                send_lookup();
+                next_lookup = now + LOOKUP_INTERVAL * 1000;
+            }
+            if (now >= next_request) {
+                request_missing();
+                next_request = now + rtime.count();
+            }
+            if (now >= next_report) {
+                report();
+                next_report = now + REPORT_INTERVAL * 1000;
+            }
+
+            uint64_t next = std::min(next_lookup, std::min(next_request, next_report));
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, (int)(next > now ? next - now : 0));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Error: relay epoll_wait, errno = " << errno << "\n";
+                return;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                switch (events[i].data.u64) {
+                case LOOKUP_TAG:
+                    receive_replies();
+                    break;
+                case DATA_TAG:
+                    receive_data();
+                    break;
+                case PARITY_TAG:
+                    forward(parity_rcv.sock, down_parity_addr);
+                    break;
+                case SILENCE_TAG:
+                    receive_silence();
+                    break;
+                case CTRL_TAG:
+                    receive_ctrl();
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    static uint64_t now_ms() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int watch(int sock, uint64_t tag) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u64 = tag;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            std::cerr << "Error: relay epoll_ctl, errno = " << errno << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    /* the socket the station's replies come to and the segment's control socket */
+    int prepare_control() {
+        lookup_rcv.prepare_to_receive();
+        fcntl(lookup_rcv.sock, F_SETFL, O_NONBLOCK);
+
+        ctrl_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in ctrl_addr = {0};
+        ctrl_addr.sin_family = AF_INET;
+        ctrl_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        ctrl_addr.sin_port = ctrl_port;
+        if (ctrl_sock < 0 || bind(ctrl_sock, (struct sockaddr *)&ctrl_addr, sizeof(ctrl_addr)) < 0) {
+            std::cerr << "Error: relay ctrl bind, errno = " << errno << "\n";
+            return 1;
+        }
+        fcntl(ctrl_sock, F_SETFL, O_NONBLOCK);
+
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            std::cerr << "Error: relay epoll, errno = " << errno << "\n";
+            return 1;
+        }
+        return watch(lookup_rcv.sock, LOOKUP_TAG) || watch(ctrl_sock, CTRL_TAG);
+    }
+
+    void send_lookup() {
+        if (sendto(lookup_rcv.sock, (void *)LOOKUP_MSG, LOOKUP_MSG_LEN, 0,
+                   (struct sockaddr *)&discover_addr, sizeof(discover_addr)) == -1)
+            std::cerr << "Error: relay lookup sendto, errno = " << errno << "\n";
+    }
+
+    /* takes the first station replying, or the one named; later replies of
+     * that station only update where its requests go */
+    void receive_replies() {
+        char buffer[MAX_CTRL_MSG_LEN];
+
+        while (true) {
+            struct sockaddr_in direct;
+            socklen_t direct_len = (socklen_t)sizeof(direct);
+            ssize_t rcv_len = recvfrom(lookup_rcv.sock, (void *)buffer, sizeof(buffer) - 1, 0,
+                                       (struct sockaddr *)&direct, &direct_len);
+            if (rcv_len < 0)
+                return;
+            buffer[rcv_len] = '\0';
+
+            struct sockaddr_in addr = {0};
+            std::string name, codec;
+            bool binary = false;
+            if (parse_reply(buffer, addr, name, binary, codec))
+                continue;
+            /* the relay's own reply, when the segments share a link */
+            if (addr.sin_addr.s_addr == down_addr.sin_addr.s_addr && addr.sin_port == down_addr.sin_port)
+                continue;
+
+            if (up_addr.sin_port == 0) {
+                if (!station_name.empty() && name != station_name)
+                    continue;
+                if (join_station(addr, name, codec))
+                    return;
+            } else if (addr.sin_addr.s_addr != up_addr.sin_addr.s_addr || addr.sin_port != up_addr.sin_port) {
+                continue;
+            }
+            up_direct = direct;
+            up_binary = binary;
+        }
+    }
+
+    /* BOREWICZ_HERE [MCAST_ADDR] [DATA_PORT] [nazwa stacji], then extension
+     * lines; returns 1 if the reply is malformed */
+    int parse_reply(char *reply, struct sockaddr_in &addr, std::string &name, bool &binary, std::string &codec) {
+        char *save = nullptr;
+        char *token = strtok_r(reply, " ", &save);
+        if (token == nullptr || strcmp(token, REPLY_MSG) != 0)
+            return 1;
+
+        token = strtok_r(nullptr, " ", &save);
+        if (token == nullptr || !inet_pton(AF_INET, token, &addr.sin_addr))
+            return 1;
+        addr.sin_family = AF_INET;
+        token = strtok_r(nullptr, " ", &save);
+        if (token == nullptr)
+            return 1;
+        /* the port is written in network order */
+        unsigned long port = strtoul(token, nullptr, 10);
+        if (port == 0 || port > 65535)
+            return 1;
+        addr.sin_port = (in_port_t)port;
+        token = strtok_r(nullptr, "\n", &save);
+        if (token == nullptr || strlen(token) > MAX_NAME_LEN)
+            return 1;
+        name = token;
+
+        std::string nack_ext(NACK_REPLY_EXT, strlen(NACK_REPLY_EXT) - 1);
+        while ((token = strtok_r(nullptr, "\n", &save)) != nullptr) {
+            if (nack_ext == token)
+                binary = true;
+            else if (strncmp(token, "+codec=", strlen("+codec=")) == 0)
+                codec = std::string(token) + "\n";
+        }
+        /* coded audio is not where the first line says */
+        if (!codec.empty()) {
+            if (ntohs(addr.sin_port) > 65535 - CODEC_PORT_OFFSET)
+                return 1;
+            addr.sin_port = htons((in_port_t)(ntohs(addr.sin_port) + CODEC_PORT_OFFSET));
+        }
+        return 0;
+    }
+
+    /* where the segment hears the audio, its parity and silence markers */
+    void place_down(in_port_t port) {
+        down_addr.sin_port = htons(port);
+        down_parity_addr = down_addr;
+        down_parity_addr.sin_port = htons((in_port_t)(port + 1));
+        down_silence_addr = down_addr;
+        down_silence_addr.sin_port = htons((in_port_t)(port + silence_marker::PORT_OFFSET));
+    }
+
+    /* joins the station's group, the ports of its parity and its silence
+     * markers, and starts answering the segment's lookups */
+    int join_station(const struct sockaddr_in &addr, const std::string &name, const std::string &codec) {
+        if (ntohs(addr.sin_port) > 65535 - silence_marker::PORT_OFFSET) {
+            std::cerr << "no ports left for parity and silence markers of station " << name << "\n";
+            return 1;
+        }
+        /* coded audio goes above the port the segment's replies name, as it came */
+        if (!codec.empty()) {
+            if (down_port > 65535 - CODEC_PORT_OFFSET - silence_marker::PORT_OFFSET) {
+                std::cerr << "no ports left for coded audio of station " << name << "\n";
+                return 1;
+            }
+            place_down((in_port_t)(down_port + CODEC_PORT_OFFSET));
+        }
+        if (data_rcv.prepare_to_receive_mcast(addr)) {
+            data_rcv.drop_mcast();
+            data_rcv.sock = -1;
+            return 1;
+        }
+        /* only the station's group, not the segment's when both are on this host */
+        int optval = 0;
+        setsockopt(data_rcv.sock, IPPROTO_IP, IP_MULTICAST_ALL, (void *)&optval, sizeof(optval));
+
+        struct sockaddr_in parity_addr = addr, silence_addr = addr;
+        parity_addr.sin_port = htons((in_port_t)(ntohs(addr.sin_port) + 1));
+        silence_addr.sin_port = htons((in_port_t)(ntohs(addr.sin_port) + silence_marker::PORT_OFFSET));
+        if (parity_rcv.prepare_to_receive_group(parity_addr) || silence_rcv.prepare_to_receive_group(silence_addr))
+            return 1;
+        if (watch(data_rcv.sock, DATA_TAG) || watch(parity_rcv.sock, PARITY_TAG) ||
+            watch(silence_rcv.sock, SILENCE_TAG))
+            return 1;
+
+        up_addr = addr;
+        codec_line = codec;
+        build_reply(name);
+        std::cerr << "relaying " << name << " from " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port)
+                  << " to " << mcast_addr_dotted << ":" << ntohs(down_addr.sin_port) << "\n";
+        return 0;
+    }
+
+    /* the segment sees the station under its name, on the relay's group;
+     * the relay takes binary requests whatever the station does */
+    void build_reply(const std::string &name) {
+        char msg[MAX_CTRL_MSG_LEN];
+        int msg_size = snprintf(msg, sizeof(msg), "%s %s %d %s\n", REPLY_MSG,
+                                mcast_addr_dotted.c_str(), htons(down_port), name.c_str());
+        reply_msg = std::string(msg, msg_size > 0 ? std::min((size_t)msg_size, sizeof(msg) - 1) : 0);
+        reply_msg.append(codec_line);
+        if (reply_msg.size() + strlen(NACK_REPLY_EXT) < MAX_CTRL_MSG_LEN)
+            reply_msg.append(NACK_REPLY_EXT);
+    }
+
+    /* forgets the previous session, the new one may use another psize */
+    void start_session(uint64_t new_session, size_t psize) {
+        session_id = new_session;
+        started = false;
+        size_t slots = std::max(fsize / psize, (size_t)2);
+        cache.init(slots, psize);
+        forward_batch.init(down_tr.sock, BATCH_SIZE, psize);
+        repair_batch.init(down_tr.sock, BATCH_SIZE, psize);
+        silent.assign(psize, 0);
+        missing.clear();
+        last_repaired.assign(slots, 0);
+        last_repaired_ms.assign(slots, 0);
+    }
+
+    /* an audiogram the relay is about to hold, ids skipped before it are lost */
+    void note_arrival(uint64_t packet_id) {
+        size_t psize = cache.get_psize();
+        uint64_t newest = cache.get_newest();
+        if (!started) {
+            started = true;
+            return;
+        }
+        if (packet_id <= newest + psize)
+            return;
+
+        uint64_t reach = (uint64_t)last_repaired.size() * psize;
+        uint64_t first = packet_id > reach ? std::max(newest + psize, packet_id - reach) : newest + psize;
+        for (uint64_t id = first; id < packet_id; id += psize)
+            missing.push_back(id);
+    }
+
+    /* forwards new audiograms to the segment, in batches of what came at
+     * once, and keeps them; packets already held, repairs made for someone
+     * else among them, stop here */
+    void receive_data() {
+        static uint8_t buffer[MAX_UDP_MSG_LEN];
+
+        while (true) {
+            ssize_t rcv_len = read(data_rcv.sock, (void *)buffer, sizeof(buffer));
+            if (rcv_len < 0)
+                break;
+            if ((size_t)rcv_len <= audiogram::HEADER_SIZE)
+                continue;
+
+            uint64_t value;
+            memcpy(&value, buffer, sizeof(value));
+            uint64_t packet_session = audiogram::ntohll(value), packet_id = audiogram::packet_id_of(buffer);
+            if (packet_session < session_id)
+                continue;
+            if (packet_session > session_id || (size_t)rcv_len != cache.get_psize()) {
+                if (!forward_batch.empty())
+                    forward_batch.flush(down_tr.sock, down_addr);
+                start_session(packet_session, (size_t)rcv_len);
+            }
+            /* held already, or too old to be kept, and so to be forwarded */
+            if (cache.find(packet_id) != nullptr ||
+                (packet_id < cache.get_newest() && !cache.in_window(packet_id)))
+                continue;
+
+            note_arrival(packet_id);
+            cache.store(buffer);
+            ++forwarded;
+            if (forward_batch.add(cache.find(packet_id)))
+                forward_batch.flush(down_tr.sock, down_addr);
+        }
+        if (!forward_batch.empty())
+            forward_batch.flush(down_tr.sock, down_addr);
+    }
+
+    /* keeps zeroed audiograms for the run a marker stands for, so requests
+     * for them are served, and passes the marker on */
+    void receive_silence() {
+        uint8_t marker[silence_marker::SIZE + 1];
+
+        while (true) {
+            ssize_t rcv_len = read(silence_rcv.sock, (void *)marker, sizeof(marker));
+            if (rcv_len < 0)
+                return;
+            uint64_t marker_session, first_id, last_id;
+            if (silence_marker::parse(marker, (size_t)rcv_len, marker_session, first_id, last_id) ||
+                marker_session != session_id || cache.get_psize() == 0)
+                continue;
+
+            size_t psize = cache.get_psize();
+            if (last_id - first_id >= last_repaired.size() * psize)
+                first_id = last_id - (last_repaired.size() - 1) * psize;
+            for (uint64_t id = first_id; id <= last_id; id += psize) {
+                if (cache.find(id) != nullptr)
+                    continue;
+                note_arrival(id);
+                audiogram::set_header(silent.data(), session_id, id);
+                cache.store(silent.data());
+                ++silent_filled;
+            }
+            sendto(down_tr.sock, (void *)marker, (size_t)rcv_len, 0,
+                   (struct sockaddr *)&down_silence_addr, sizeof(down_silence_addr));
+        }
+    }
+
+    void forward(int sock, const struct sockaddr_in &to) {
+        static uint8_t buffer[MAX_UDP_MSG_LEN];
+
+        while (true) {
+            ssize_t rcv_len = read(sock, (void *)buffer, sizeof(buffer));
+            if (rcv_len < 0)
+                return;
+            sendto(down_tr.sock, (void *)buffer, (size_t)rcv_len, 0, (struct sockaddr *)&to, sizeof(to));
+        }
+    }
+
+    /* lookups and retransmission requests of the segment */
+    void receive_ctrl() {
+        static char buffer[MAX_UDP_MSG_LEN];
+
+        while (true) {
+            struct sockaddr_in rcv_addr;
+            socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
+            ssize_t rcv_len = recvfrom(ctrl_sock, (void *)buffer, sizeof(buffer) - 1, 0,
+                                       (struct sockaddr *)&rcv_addr, &rcv_addr_len);
+            if (rcv_len < 0)
+                break;
+            buffer[rcv_len] = '\0';
+
+            if ((size_t)rcv_len == LOOKUP_MSG_LEN && strcmp(buffer, LOOKUP_MSG) == 0) {
+                if (!reply_msg.empty() && reply_filter.admit(rcv_addr, now_ms()))
+                    sendto(ctrl_sock, (void *)reply_msg.data(), reply_msg.size(), 0,
+                           (struct sockaddr *)&rcv_addr, rcv_addr_len);
+            } else if (cache.get_psize() == 0) {
+                continue;
+            } else if (strncmp(buffer, REXMIT_MSG, strlen(REXMIT_MSG)) == 0) {
+                char *save = nullptr;
+                for (char *token = strtok_r(buffer + strlen(REXMIT_MSG), ",\n", &save); token != nullptr;
+                     token = strtok_r(nullptr, ",\n", &save))
+                    repair(audiogram::ntohll(strtoull(token, nullptr, 10)));
+            } else if (binary_nack::is_nack((uint8_t *)buffer, (size_t)rcv_len)) {
+                binary_nack::decode((uint8_t *)buffer, (size_t)rcv_len, cache.get_psize(), last_repaired.size(),
+                                    [this](uint64_t id) { repair(id); });
+            }
+        }
+        if (!repair_batch.empty())
+            repair_batch.flush(down_tr.sock, down_addr);
+    }
+
+    /* multicasts a held packet to the segment, at most once per rtime, or
+     * passes the request on to the station */
+    void repair(uint64_t packet_id) {
+        uint8_t *packet = cache.find(packet_id);
+        if (packet == nullptr) {
+            if (cache.in_window(packet_id)) {
+                missing.push_back(packet_id);
+                ++requests_passed;
+            }
+            return;
+        }
+
+        size_t slot = (size_t)(packet_id / cache.get_psize() % last_repaired.size());
+        uint64_t now = now_ms();
+        if (last_repaired[slot] == packet_id + 1 && now - last_repaired_ms[slot] < (uint64_t)rtime.count())
+            return;
+        last_repaired[slot] = packet_id + 1;
+        last_repaired_ms[slot] = now;
+        ++repairs_served;
+        if (repair_batch.add(packet))
+            repair_batch.flush(down_tr.sock, down_addr);
+    }
+
+    /* asks the station for what the relay lost, repeated once per rtime
+     * until the packets come or leave the cache */
+    void request_missing() {
+        if (missing.empty() || up_direct.sin_port == 0)
+            return;
+
+        std::sort(missing.begin(), missing.end());
+        missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+        missing.erase(std::remove_if(missing.begin(), missing.end(), [this](uint64_t id) {
+            return cache.find(id) != nullptr || !cache.in_window(id);
+        }), missing.end());
+        if (missing.empty())
+            return;
+
+        std::vector<std::string> datagrams;
+        if (up_binary)
+            binary_nack::encode(missing, cache.get_psize(), datagrams);
+        else
+            text_nack::encode(missing, datagrams);
+        for (const std::string &datagram : datagrams)
+            sendto(lookup_rcv.sock, (void *)datagram.data(), datagram.size(), 0,
+                   (struct sockaddr *)&up_direct, sizeof(up_direct));
+        ids_requested += missing.size();
+    }
+
+    void report() {
+        std::cerr << "relay: " << forwarded << " audiograms forwarded, " << silent_filled << " silent ones kept, "
+                  << repairs_served << " repairs served, " << requests_passed << " requests passed on, "
+                  << ids_requested << " audiograms requested from the station\n";
+    }
+};
+
+int main(int argc, char *argv[]) {
+    radio_relay r;
+    if (r.init(argc, argv)) return 1;
+    r.work();
+
+    return 0;
+}
@@ -1,71 +1,156 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
 #include <cstdint>
 #include <cerrno>
 #include <chrono>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <memory>
+#include <vector>
 #include <limits>
-#include <queue>
-#include <set>
+#include <algorithm>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include "boost/circular_buffer.hpp"
 #include "boost/program_options.hpp"
 #include "audiogram.h"
 #include "audio_transmitter.h"
+#include "packet_ring.h"
+#include "station.h"
+#include "stage_signal.h"
+#include "lookup_filter.h"
+#include "nack.h"
+#include "metrics.h"
 #include "receiver.h"
 #include "const.h"
 
 
 class radio_transmitter : protected audio_transmitter {
 private:
-    boost::circular_buffer<audiogram> data_q;
-    std::unique_ptr<std::set<uint64_t>> retransmit_nums_ptr;
-    std::queue<sockaddr_in> replies_q;
-    std::mutex retransmit_nums_mut;
-    std::mutex replies_mut;
-    std::atomic_flag keep_listening_lookups = ATOMIC_FLAG_INIT;
-    std::atomic_flag keep_listening_rexmits = ATOMIC_FLAG_INIT;
-    std::atomic_flag stop_replying = ATOMIC_FLAG_INIT;
+    static const size_t MAX_REPLY_BATCH = 64;
+
+    ring_arena fifo_arena;
+    std::vector<std::unique_ptr<station>> stations;
+    std::vector<std::unique_ptr<stage_signal>> worker_signals; // one per send worker
+    std::mutex rexmit_mut;
+    std::condition_variable rexmit_cv;
+    bool rexmit_pending = false; // guarded by rexmit_mut
+    bool keep_retransmitting = true; // guarded by rexmit_mut
+
+    /* one per send worker, and one for the repair thread */
+    std::vector<std::unique_ptr<latency_histogram>> send_loop_times;
+    latency_histogram repair_times;
+    int stats_sock = -1;
+
+    /* lookup replies, used by the control loop only; counters read by the stats thread too */
+    std::vector<sockaddr_in> reply_addrs;
+    std::vector<struct mmsghdr> reply_msgs;
+    lookup_filter reply_filter;
+    pacer reply_pacer;
+    std::atomic<uint64_t> lookups_received{0};
+    std::atomic<uint64_t> lookups_answered{0};
+    std::atomic<uint64_t> lookups_coalesced{0};
+    std::atomic<uint64_t> lookups_dropped{0};
     int rcv_sock = -1;
+    int ctrl_epoll = -1;
+    int ctrl_stop = -1; // eventfd ending the control loop
+    std::chrono::seconds stats_interval = std::chrono::seconds(10);
 
 public:
     ~radio_transmitter() {
         close(rcv_sock);
+        close(stats_sock);
+        close(ctrl_epoll);
+        close(ctrl_stop);
     }
 
     int init(int argc, char *argv[]) override {
-        data_q = boost::circular_buffer<audiogram>(fsize / psize);
-        retransmit_nums_ptr = std::make_unique<std::set<uint64_t>>();
-        audio_transmitter::init(argc, argv);
-        fcntl(replies_tr.sock, F_SETFL, O_NONBLOCK);
-//        std::ios_base::sync_with_stdio(false);
-//        std::cin.tie(nullptr);
-//        std::cerr.tie(nullptr);
+        if (audio_transmitter::init(argc, argv))
+            return 1;
+
+        /* every station gets a ring of the same geometry cut from one arena */
+        size_t slots = std::max(fsize / psize, (size_t)2);
+        size_t ring_len = packet_ring::footprint(slots, psize);
+        if (fifo_arena.init(ring_len * specs.size(), hugepages, fifo_path))
+            return 1;
+
+        for (size_t w = 0; w < send_workers; ++w) {
+            worker_signals.push_back(std::make_unique<stage_signal>());
+            send_loop_times.push_back(std::make_unique<latency_histogram>());
+        }
+        station_settings settings = {psize, batch_size, ingest_depth, rate, rexmit_share, jitter_size, rtime,
+                                     reader_cpu, fec_block, unicast_limit, codec_channels, silence_threshold,
+                                     catch_up_share, nack_group};
+        for (size_t i = 0; i < specs.size(); ++i) {
+            stations.push_back(std::make_unique<station>());
+            if (stations.back()->init(specs[i], settings, audio_tr.sock, fifo_arena.at(i * ring_len), slots,
+                                      fifo_arena.is_persistent(), worker_signals[i % send_workers].get()))
+                return 1;
+        }
+        if (prepare_control() || prepare_stats())
+            return 1;
+
+        if (rate > 0)
+            std::cerr << "pacing at " << rate << " B/s per station\n";
+        if (fec_block > 0)
+            std::cerr << "one parity audiogram every " << fec_block << " audiograms\n";
+        if (codec_channels > 0)
+            std::cerr << "coding " << codec_channels << " channel(s) to IMA-ADPCM, "
+                      << ima_adpcm::pcm_size(psize - audiogram::HEADER_SIZE, codec_channels)
+                      << " PCM bytes per audiogram, sent from data_port + " << CODEC_PORT_OFFSET << " on\n";
+        if (silence_threshold >= 0)
+            std::cerr << "audiograms peaking at " << silence_threshold << " or below are replaced by silence markers\n";
+        if (nack_group)
+            std::cerr << "receivers share requests on the group at data_port + " << NACK_GROUP_PORT_OFFSET
+                      << ", their repairs are multicast\n";
+        if (unicast_limit > 0)
+            std::cerr << "repairs asked for by up to " << unicast_limit << " receiver(s) go by unicast\n";
+        if (catch_up_share > 0)
+            std::cerr << "receivers tuning in catch up at up to " << catch_up_share << "% of the live rate\n";
+        if (stats_port > 0)
+            std::cerr << "metrics on 127.0.0.1:" << stats_port << ", GET /metrics for Prometheus\n";
+        std::cerr << specs.size() << " station(s) on " << send_workers << " send worker(s), batching up to "
+                  << batch_size << " audiograms" << (stations[0]->uses_gso() ? " with UDP GSO\n" : " with sendmmsg\n");
+
+        return 0;
     }
 
     void work() {
-        keep_listening_lookups.test_and_set();
-        std::thread t1(&radio_transmitter::listen_for_incoming_lookups, this);
-        stop_replying.test_and_set();
-        std::thread t2(&radio_transmitter::send_replies, this);
-        keep_listening_rexmits.test_and_set();
-        std::thread t3(&radio_transmitter::listen_for_incoming_rexmits, this);
-
-        transmit_and_retransmit();
-        keep_listening_lookups.clear();
-        keep_listening_rexmits.clear();
-        stop_replying.clear();
-
-        t1.join();
-        t2.join();
-        t3.join();
+        std::vector<std::thread> threads;
+        threads.emplace_back(&radio_transmitter::control_loop, this);
+        threads.emplace_back(&radio_transmitter::retransmit, this);
+        if (stats_sock >= 0 || stats_dump > 0)
+            threads.emplace_back(&radio_transmitter::serve_stats, this);
+        for (std::unique_ptr<station> &st : stations)
+            threads.emplace_back(&station::ingest, st.get());
+        std::vector<std::thread> workers;
+        for (size_t w = 1; w < send_workers; ++w)
+            workers.emplace_back(&radio_transmitter::transmit, this, w);
+
+        transmit(0);
+        for (std::thread &t : workers)
+            t.join();
+        uint64_t stop = 1;
+        if (write(ctrl_stop, &stop, sizeof(stop)) != sizeof(stop))
+            std::cerr << "Error: control stop write, errno = " << errno << "\n";
+        rexmit_mut.lock();
+        keep_retransmitting = false;
+        rexmit_mut.unlock();
+        rexmit_cv.notify_one();
+
+        for (std::thread &t : threads)
+            t.join();
     }
 
 private:
@@ -87,13 +172,6 @@ private:
                 std::cerr << "Error: setsockopt broadcast\n";
                 err = 1;
             }
-            struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 300000;
-            if (setsockopt(rcv_sock, SOL_SOCKET, SO_RCVTIMEO,&tv,sizeof(tv)) < 0) {
-                std::cerr << "Error: setsockopt rcvtimeo\n";
-                err = 1;
-            }
 
             server_address.sin_family = AF_INET; // IPv4
             server_address.sin_addr.s_addr = htonl(INADDR_ANY); // listening on all interfaces
@@ -106,125 +184,455 @@ private:
                 err = 1;
             }
         } while (err);
+        fcntl(rcv_sock, F_SETFL, O_NONBLOCK);
     }
 
-    void transmit_and_retransmit() {
-        namespace ch = std::chrono;
-        uint64_t packet_id = 0, session_id = (uint64_t)time(nullptr);
-
-        std::cerr << "session " << session_id << " sent\n";
-        while (!std::cin.eof()) {
-            /* transmit */
-            auto start = std::chrono::system_clock::now();
-            do {
-                audiogram a(psize, 1);
-                a.set_size(psize);
-                a.set_session_id(audiogram::htonll(session_id));
-                a.set_packet_id(audiogram::htonll(packet_id));
-                std::cin.read((char *)a.get_audio_data(), psize - audiogram::HEADER_SIZE);
-                if (std::cin.fail())
-                    return;
+    /* epoll tags of the sockets that are not a station's reply socket */
+    uint64_t lookup_tag() const {
+        return stations.size();
+    }
 
-                send_audiogram(a);
+    uint64_t stop_tag() const {
+        return stations.size() + 1;
+    }
 
-                data_q.push_back(std::move(a));
-                packet_id += psize;
-            } while (ch::system_clock::now() - start < rtime && !std::cin.eof());
+    /* tag of the socket a station takes requests sent to its group on */
+    uint64_t nack_group_tag(size_t station) const {
+        return stations.size() + 2 + station;
+    }
 
-            /* retransmit */
-            retransmit_nums_mut.lock();
-            std::unique_ptr<std::set<uint64_t>> nums_ptr =
-                    std::move(retransmit_nums_ptr);
-            retransmit_nums_ptr = std::make_unique<std::set<uint64_t>>();
-            retransmit_nums_mut.unlock();
+    /* one epoll set for lookups, every station's retransmission requests and shutdown */
+    int prepare_control() {
+        prepare_to_receive();
 
-            int q = 0;
-            for (uint64_t num : *nums_ptr) {
-                while (q < data_q.size() && num > data_q[q].get_packet_id())
-                    ++q;
-                if (q == data_q.size())
-                    break;
+        reply_addrs.reserve(MAX_REPLY_BATCH);
+        reply_msgs = std::vector<struct mmsghdr>(MAX_REPLY_BATCH);
+        reply_filter.init(4096, reply_window);
+        reply_pacer.init(reply_rate, (size_t)std::max(reply_rate, (double)MAX_REPLY_BATCH));
 
-                if (num == data_q[q].get_packet_id())
-                    send_audiogram(data_q[q]);
+        ctrl_stop = eventfd(0, EFD_NONBLOCK);
+        ctrl_epoll = epoll_create1(0);
+        if (ctrl_stop < 0 || ctrl_epoll < 0) {
+            std::cerr << "Error: control epoll, errno = " << errno << "\n";
+            return 1;
+        }
 
-                ++q;
+        std::vector<std::pair<int, uint64_t>> watched = {{rcv_sock, lookup_tag()}, {ctrl_stop, stop_tag()}};
+        for (size_t i = 0; i < stations.size(); ++i) {
+            watched.push_back({stations[i]->get_reply_sock(), i});
+            if (stations[i]->get_nack_group_sock() >= 0)
+                watched.push_back({stations[i]->get_nack_group_sock(), nack_group_tag(i)});
+        }
+        for (const std::pair<int, uint64_t> &w : watched) {
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN;
+            ev.data.u64 = w.second;
+            if (epoll_ctl(ctrl_epoll, EPOLL_CTL_ADD, w.first, &ev) < 0) {
+                std::cerr << "Error: control epoll_ctl, errno = " << errno << "\n";
+                return 1;
             }
         }
+        return 0;
     }
 
-    void listen_for_incoming_lookups() {
-        prepare_to_receive();
-        char buffer[MAX_UDP_MSG_LEN];
+    static void pin_to_cpu(int cpu, const char *stage) {
+        if (cpu < 0)
+            return;
 
-        while (keep_listening_lookups.test_and_set()) {
-            struct sockaddr_in rcv_addr;
-            socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
-            ssize_t rcv_len = recvfrom(rcv_sock, (void *)&buffer, sizeof(buffer),
-                    0, (struct sockaddr *)&rcv_addr, &rcv_addr_len);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            std::cerr << "Error: pinning " << stage << " stage to cpu " << cpu << ", errno = " << err << "\n";
+    }
 
-            if (rcv_len < 0) {
-                //std::cerr << "Error: rcv_ctrl rcvfrom\n";
-            } else {
-                //printf("read %zd bytes: %.*s\n", rcv_len, (int) rcv_len, buffer);
-                buffer[rcv_len] = '\0';
-
-                if (buffer[0] == LOOKUP_MSG[0]) {
-                    if (!parse_lookup(buffer, (size_t)rcv_len)) {
-                        replies_mut.lock();
-                        replies_q.push(rcv_addr);
-                        std::cerr << "reply pushed with " << inet_ntoa(rcv_addr.sin_addr) << "\n";
-                        replies_mut.unlock();
-                    }
-                }
+    /* Send worker: runs the send stage of every send_workers-th station,
+     * sleeping when all of them wait for input or for their pacers. */
+    void transmit(size_t worker) {
+        std::vector<station *> own;
+        for (size_t i = worker; i < stations.size(); i += send_workers)
+            own.push_back(stations[i].get());
+        stage_signal &ingest_ready = *worker_signals[worker];
+        latency_histogram &loop_times = *send_loop_times[worker];
+        pacer::clock::time_point next_report = pacer::clock::now() + stats_interval;
+
+        pin_to_cpu(sender_cpu < 0 ? -1 : sender_cpu + (int)worker, "sender");
+        while (true) {
+            pacer::clock::duration wait = pacer::clock::duration::max();
+            bool busy = false;
+            pacer::clock::time_point start = pacer::clock::now();
+            for (station *st : own) {
+                if (st->is_finished())
+                    continue;
+                pacer::clock::duration d = st->pump();
+                if (d != pacer::clock::duration::zero())
+                    wait = std::min(wait, d);
+                busy |= !st->is_finished();
+            }
+            loop_times.record(pacer::clock::now() - start);
+            if (!busy)
+                break;
+
+            if (pacer::clock::now() >= next_report) {
+                for (station *st : own)
+                    st->report();
+                next_report += stats_interval;
             }
+
+            /* a station out of tokens waits less than a packet, the others are polled meanwhile */
+            if (wait != pacer::clock::duration::max())
+                std::this_thread::sleep_for(wait);
+            else
+                ingest_ready.wait([&] {
+                    return std::any_of(own.begin(), own.end(), [](station *st) { return st->has_work(); });
+                });
         }
+        for (station *st : own)
+            st->report();
     }
 
-    void listen_for_incoming_rexmits() {
+    /* Serves the stations' retransmission requests once per rtime or as soon
+     * as new requests come in, within each station's own repair budget;
+     * sooner while catch-up bursts wait for tokens. */
+    void retransmit() {
+        pacer::clock::duration wait = rtime;
+        while (true) {
+            std::unique_lock<std::mutex> lock(rexmit_mut);
+            rexmit_cv.wait_for(lock, wait, [this] { return rexmit_pending || !keep_retransmitting; });
+            if (!keep_retransmitting)
+                return;
+            rexmit_pending = false;
+            lock.unlock();
+
+            wait = rtime;
+            pacer::clock::time_point start = pacer::clock::now();
+            for (std::unique_ptr<station> &st : stations)
+                wait = std::min(wait, st->retransmit());
+            repair_times.record(pacer::clock::now() - start);
+        }
+    }
+
+    /* Handles the whole control plane: sleeps in epoll until a lookup or a
+     * retransmission request for any station comes in, or until work() asks
+     * it to stop. */
+    void control_loop() {
+        static const int MAX_EVENTS = 16;
+        struct epoll_event events[MAX_EVENTS];
         char buffer[MAX_UDP_MSG_LEN];
+        std::vector<uint64_t> results;
+        pacer::clock::time_point next_report = pacer::clock::now() + stats_interval;
+
+        while (true) {
+            int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    next_report - pacer::clock::now()).count();
+            int n = epoll_wait(ctrl_epoll, events, MAX_EVENTS, std::max(timeout, 0));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Error: control epoll_wait, errno = " << errno << "\n";
+                return;
+            }
+
+            bool requested = false;
+            for (int i = 0; i < n; ++i) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == stop_tag()) {
+                    report_lookups();
+                    return;
+                }
+                if (tag == lookup_tag())
+                    receive_lookups();
+                else if (tag >= nack_group_tag(0))
+                    requested |= receive_rexmits(*stations[tag - nack_group_tag(0)], true,
+                                                 buffer, sizeof(buffer), results);
+                else
+                    requested |= receive_rexmits(*stations[tag], false, buffer, sizeof(buffer), results);
+            }
+            if (!reply_addrs.empty())
+                send_replies();
+
+            if (requested) {
+                rexmit_mut.lock();
+                rexmit_pending = true;
+                rexmit_mut.unlock();
+                rexmit_cv.notify_one();
+            }
+            if (pacer::clock::now() >= next_report) {
+                report_lookups();
+                next_report += stats_interval;
+            }
+        }
+    }
 
-        while (keep_listening_rexmits.test_and_set()) {
+    /* Local TCP socket metrics are read from, on 127.0.0.1 only. */
+    int prepare_stats() {
+        if (stats_port == 0)
+            return 0;
+
+        stats_sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (stats_sock < 0) {
+            std::cerr << "Error: stats socket, errno = " << errno << "\n";
+            return 1;
+        }
+        int optval = 1;
+        setsockopt(stats_sock, SOL_SOCKET, SO_REUSEADDR, (void *)&optval, sizeof(optval));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(stats_port);
+        if (bind(stats_sock, (struct sockaddr *)&address, (socklen_t)sizeof(address)) < 0 ||
+            listen(stats_sock, 16) < 0) {
+            std::cerr << "Error: stats bind, errno = " << errno << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    /* Stats thread: answers whoever connects to the stats socket and dumps
+     * the metrics to stderr every stats_dump seconds, until work() stops the
+     * control loop. Everything it reads is atomic, so the stages it watches
+     * neither lock nor allocate for it. */
+    void serve_stats() {
+        std::chrono::seconds dump_interval(stats_dump);
+        pacer::clock::time_point next_dump = pacer::clock::now() + dump_interval;
+
+        while (true) {
+            struct pollfd fds[2] = {{ctrl_stop, POLLIN, 0}, {stats_sock, POLLIN, 0}};
+            int timeout = -1;
+            if (stats_dump > 0)
+                timeout = (int)std::max(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        next_dump - pacer::clock::now()).count(), (std::chrono::milliseconds::rep)0);
+            int n = poll(fds, stats_sock >= 0 ? 2 : 1, timeout);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Error: stats poll, errno = " << errno << "\n";
+                return;
+            }
+            if (fds[0].revents & POLLIN)
+                return;
+            if (stats_sock >= 0 && (fds[1].revents & POLLIN))
+                answer_stats();
+
+            if (stats_dump > 0 && pacer::clock::now() >= next_dump) {
+                std::string out;
+                render_metrics(out, false);
+                std::cerr << out;
+                next_dump += dump_interval;
+            }
+        }
+    }
+
+    /* "GET /metrics" gets the Prometheus format over HTTP, any other GET the
+     * plain one over HTTP, and a client that sends nothing the plain one as is */
+    void answer_stats() {
+        int conn = accept(stats_sock, nullptr, nullptr);
+        if (conn < 0)
+            return;
+
+        struct timeval timeout = {0, 200 * 1000};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout, sizeof(timeout));
+        char request[512];
+        ssize_t len = recv(conn, request, sizeof(request) - 1, 0);
+        request[std::max(len, (ssize_t)0)] = '\0';
+
+        bool http = strncmp(request, "GET ", 4) == 0;
+        bool prometheus = strncmp(request, "GET /metrics", 12) == 0 &&
+                          (request[12] == ' ' || request[12] == '?' || request[12] == '\r');
+        std::string body;
+        render_metrics(body, prometheus);
+        std::string out;
+        if (http)
+            out = std::string("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n") +
+                  "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        out += body;
+
+        size_t sent = 0;
+        while (sent < out.size()) {
+            ssize_t res = send(conn, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (res < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            sent += res;
+        }
+        close(conn);
+    }
+
+    /* every station's metrics labelled with its name, then the lookup
+     * counters and the latency of the send and repair passes */
+    void render_metrics(std::string &out, bool prometheus) {
+        metrics_writer writer(out, prometheus);
+        std::vector<std::vector<metric_sample>> samples(stations.size());
+        std::vector<std::string> labels;
+        for (size_t i = 0; i < stations.size(); ++i) {
+            stations[i]->sample(samples[i]);
+            labels.push_back(metrics_writer::label("station", stations[i]->get_name()));
+        }
+        for (size_t m = 0; !samples.empty() && m < samples[0].size(); ++m) {
+            writer.family(samples[0][m].name, samples[0][m].help, samples[0][m].counter ? "counter" : "gauge");
+            for (size_t i = 0; i < stations.size(); ++i)
+                writer.sample(samples[i][m].name, labels[i], samples[i][m].value);
+        }
+
+        const metric_sample lookups[] = {
+                {"sikradio_lookups_received_total", "Lookups received.", true, lookups_received},
+                {"sikradio_lookups_answered_total", "Lookups answered, by every station.", true, lookups_answered},
+                {"sikradio_lookups_coalesced_total", "Lookups not answered as the source asked just before.",
+                 true, lookups_coalesced},
+                {"sikradio_lookups_dropped_total", "Lookups not answered beyond the reply rate.", true,
+                 lookups_dropped}};
+        for (const metric_sample &l : lookups) {
+            writer.family(l.name, l.help, "counter");
+            writer.sample(l.name, "", l.value);
+        }
+
+        writer.family("sikradio_send_loop_seconds", "Time a send worker spends on one pass over its stations.",
+                      "histogram");
+        for (size_t w = 0; w < send_loop_times.size(); ++w)
+            writer.histogram("sikradio_send_loop_seconds", metrics_writer::label("worker", std::to_string(w)),
+                             *send_loop_times[w]);
+        writer.family("sikradio_repair_pass_seconds", "Time one pass of the repair thread over all stations takes.",
+                      "histogram");
+        writer.histogram("sikradio_repair_pass_seconds", "", repair_times);
+    }
+
+    void report_lookups() {
+        std::cerr << "lookups: " << lookups_received << " received, " << lookups_answered
+                  << " answered, " << lookups_coalesced << " coalesced, " << lookups_dropped << " dropped\n";
+    }
+
+    /* Takes lookups in batches with recvmmsg. A source asking again within
+     * reply_window gets no new reply, and replies beyond reply_rate are dropped,
+     * so a lookup storm costs a bounded amount of work. */
+    void receive_lookups() {
+        static const size_t BATCH = 64;
+        char buffers[BATCH][MAX_CTRL_MSG_LEN];
+        struct sockaddr_in addrs[BATCH];
+        struct iovec iov[BATCH];
+        struct mmsghdr msgs[BATCH];
+
+        for (size_t i = 0; i < BATCH; ++i) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = MAX_CTRL_MSG_LEN - 1;
+        }
+
+        int n;
+        do {
+            for (size_t i = 0; i < BATCH; ++i) {
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            n = recvmmsg(rcv_sock, msgs, BATCH, MSG_DONTWAIT, nullptr);
+            if (n <= 0)
+                return;
+            lookups_received += n;
+
+            uint64_t now_ms = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    pacer::clock::now().time_since_epoch()).count();
+            for (int i = 0; i < n; ++i) {
+                char *buffer = buffers[i];
+                buffer[msgs[i].msg_len] = '\0';
+                if (buffer[0] != LOOKUP_MSG[0] || parse_lookup(buffer, msgs[i].msg_len))
+                    continue;
+
+                if (!reply_filter.admit(addrs[i], now_ms)) {
+                    ++lookups_coalesced;
+                } else if (reply_pacer.delay(1) != pacer::clock::duration::zero()) {
+                    ++lookups_dropped;
+                } else {
+                    reply_pacer.consume(1);
+                    reply_addrs.push_back(addrs[i]);
+                    if (reply_addrs.size() == MAX_REPLY_BATCH)
+                        send_replies();
+                }
+            }
+        } while (n == (int)BATCH);
+    }
+
+    /* Reads requests from the station's reply socket, or from its group when
+     * from_group is set; a request made to the group stands for every
+     * receiver that held its own back, so it is repaired by multicast.
+     * Catch-up requests are taken from the reply socket only, as they are
+     * answered to the receiver that made them. Returns true if any packet
+     * held by the station was requested. */
+    bool receive_rexmits(station &st, bool from_group, char *buffer, size_t size, std::vector<uint64_t> &results) {
+        bool requested = false;
+        int sock = from_group ? st.get_nack_group_sock() : st.get_reply_sock();
+
+        while (true) {
             struct sockaddr_in rcv_addr;
             socklen_t rcv_addr_len = (socklen_t)sizeof(rcv_addr);
-            ssize_t rcv_len = recvfrom(replies_tr.sock, (void *)&buffer, sizeof(buffer),
+            ssize_t rcv_len = recvfrom(sock, (void *)buffer, size - 1,
                                        0, (struct sockaddr *)&rcv_addr, &rcv_addr_len);
-
-            if (rcv_len < 0) {
-                //std::cerr << "Error: rcv_ctrl rcvfrom\n";
-            } else {
-                //printf("read %zd bytes: %.*s\n", rcv_len, (int) rcv_len, buffer);
-                buffer[rcv_len] = '\0';
-
-                if (buffer[0] == REXMIT_MSG[0]) {
-                    std::vector<uint64_t> results;
-                    if (!parse_rexmit(buffer, (size_t)rcv_len, results)) {
-                        retransmit_nums_mut.lock();
-                        for(uint64_t res : results)
-                            retransmit_nums_ptr->insert(res);
-                        retransmit_nums_mut.unlock();
-                    }
+            if (rcv_len < 0)
+                break;
+            if (from_group)
+                rcv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+            buffer[rcv_len] = '\0';
+            if (buffer[0] == REXMIT_MSG[0]) {
+                results.clear();
+                int err = parse_rexmit(buffer, (size_t)rcv_len, results);
+                if (!err) {
+                    for (uint64_t res : results)
+                        requested |= !st.request(res, rcv_addr.sin_addr.s_addr);
                 }
+                st.count_request(!err);
+            } else if (binary_nack::is_nack((uint8_t *)buffer, (size_t)rcv_len)) {
+                int err = binary_nack::decode((uint8_t *)buffer, (size_t)rcv_len, psize, st.capacity(),
+                        [&](uint64_t id) { requested |= !st.request(id, rcv_addr.sin_addr.s_addr); });
+                st.count_request(!err);
+            } else if (!from_group) {
+                uint64_t first_id;
+                uint32_t count;
+                int err = catch_up_request::decode((uint8_t *)buffer, (size_t)rcv_len, first_id, count);
+                if (!err)
+                    requested |= !st.catch_up(rcv_addr.sin_addr.s_addr, first_id, count);
+                st.count_request(!err);
+            } else {
+                st.count_request(false);
             }
         }
+        return requested;
     }
 
+    /* every station answers each lookup from its own socket, where its
+     * retransmission requests will then come from */
     void send_replies() {
-        while (stop_replying.test_and_set()) {
-            int not_empty = 0;
-            sockaddr_in addr;
-            replies_mut.lock();
-            if (!replies_q.empty()) {
-                addr = replies_q.back();
-                replies_q.pop();
-                not_empty = 1;
+        size_t n = reply_addrs.size();
+
+        for (std::unique_ptr<station> &st : stations) {
+            struct iovec reply_iov = {(void *)st->get_reply().data(), st->get_reply().size()};
+            for (size_t i = 0; i < n; ++i) {
+                memset(&reply_msgs[i].msg_hdr, 0, sizeof(reply_msgs[i].msg_hdr));
+                reply_msgs[i].msg_hdr.msg_name = &reply_addrs[i];
+                reply_msgs[i].msg_hdr.msg_namelen = sizeof(reply_addrs[i]);
+                reply_msgs[i].msg_hdr.msg_iov = &reply_iov;
+                reply_msgs[i].msg_hdr.msg_iovlen = 1;
             }
-            replies_mut.unlock();
 
-            if (not_empty) {
-                send_reply(addr);
+            size_t sent = 0;
+            while (sent < n) {
+                int res = sendmmsg(st->get_reply_sock(), &reply_msgs[sent], (unsigned int)(n - sent), 0);
+                if (res < 0) {
+                    if (errno != EINTR) {
+                        std::cerr << "Error: reply sendmmsg, errno = " << errno << "\n";
+                        break;
+                    }
+                    continue;
+                }
+                sent += res;
             }
         }
+        lookups_answered += n;
+        reply_addrs.clear();
     }
 
     int parse_lookup(const char *msg, size_t len) {
@@ -242,17 +650,16 @@ private:
         strtok(msg, " ");
         char *token = strtok(nullptr, ",");
 
+        /* ids are parsed in place; byte-swapped they are mostly too long for a
+         * std::string to hold without allocating */
         while (token != nullptr) {
-            std::string tok(token);
+            char *end = nullptr;
+            errno = 0;
+            unsigned long long value = strtoull(token, &end, 10);
 
-            if (tok[0] == '-')
+            if (token[0] == '-' || end == token || errno == ERANGE || (*end != '\0' && !isspace((unsigned char)*end)))
                 err = 1;
-
-            try {
-                res = audiogram::ntohll(std::stoull(tok));
-            } catch (const std::exception &e) {
-                err = 1;
-            }
+            res = audiogram::ntohll(value);
 
             if (!err)
                 results.push_back(res);
@@ -82,6 +82,47 @@ public:
         return err;
     }
 
+    /* gives up a group socket half set up */
+    int drop_group() {
+        close(sock);
+        sock = -1;
+        return 1;
+    }
+
+    /* Joins a group shared by several hosts and processes: bound to the group
+     * address itself, so only its datagrams come in, with SO_REUSEADDR, so
+     * everyone on the host can listen at once. On failure the socket is closed
+     * and sock is -1. */
+    int prepare_to_receive_group(sockaddr_in addr) {
+        struct ip_mreq ip_mreq;
+
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0) {
+            std::cerr << "Error: group socket, errno = " << errno << "\n";
+            return 1;
+        }
+
+        int optval = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&optval, sizeof(optval)) < 0) {
+            std::cerr << "Error: group setsockopt reuseaddr, errno = " << errno << "\n";
+            return drop_group();
+        }
+        ip_mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        ip_mreq.imr_multiaddr = addr.sin_addr;
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void *)&ip_mreq, sizeof(ip_mreq)) < 0) {
+            std::cerr << "Error: group setsockopt membership, errno = " << errno << "\n";
+            return drop_group();
+        }
+        addr.sin_family = AF_INET;
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            std::cerr << "Error: group bind, errno = " << errno << "\n";
+            return drop_group();
+        }
+
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        return 0;
+    }
+
     int drop_mcast() {
         close(sock);
     }
@@ -0,0 +1,72 @@
+#ifndef RADIO_REPAIR_CACHE_H
+#define RADIO_REPAIR_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "audiogram.h"
+
+/* The relay's copy of the audiograms it forwarded, kept to answer the
+ * requests of its segment. Packets come with their own ids, out of order and
+ * with gaps, so each slot remembers the id it holds; a packet goes to slot
+ * id / psize % slots and is held until a newer one takes the slot or falls
+ * out of the window of the newest slots packets. */
+class repair_cache {
+private:
+    std::vector<uint8_t> slab;
+    std::vector<uint64_t> held; // id of the packet in each slot plus one, 0 if empty
+    size_t slots = 0;
+    size_t psize = 0;
+    uint64_t newest = 0;
+
+    size_t index_of(uint64_t packet_id) const {
+        return (size_t)(packet_id / psize % slots);
+    }
+
+public:
+    /* forgets all packets */
+    void init(size_t slots, size_t psize) {
+        this->slots = slots;
+        this->psize = psize;
+        slab.assign(slots * psize, 0);
+        held.assign(slots, 0);
+        newest = 0;
+    }
+
+    size_t get_psize() const {
+        return psize;
+    }
+
+    uint64_t get_newest() const {
+        return newest;
+    }
+
+    /* true if the id is not older than the cache reaches back */
+    bool in_window(uint64_t packet_id) const {
+        return packet_id <= newest && newest - packet_id < slots * psize;
+    }
+
+    /* copies a whole audiogram, psize bytes, into its slot */
+    void store(const uint8_t *packet) {
+        uint64_t packet_id = audiogram::packet_id_of(packet);
+        if (newest > packet_id && !in_window(packet_id))
+            return;
+
+        size_t index = index_of(packet_id);
+        memcpy(slab.data() + index * psize, packet, psize);
+        held[index] = packet_id + 1;
+        if (packet_id > newest)
+            newest = packet_id;
+    }
+
+    /* the stored audiogram, nullptr if it is not held */
+    uint8_t *find(uint64_t packet_id) {
+        if (slots == 0 || !in_window(packet_id))
+            return nullptr;
+        size_t index = index_of(packet_id);
+        return held[index] == packet_id + 1 ? slab.data() + index * psize : nullptr;
+    }
+};
+
+
+#endif //RADIO_REPAIR_CACHE_H
@@ -0,0 +1,62 @@
+#ifndef RADIO_REXMIT_BITMAP_H
+#define RADIO_REXMIT_BITMAP_H
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+
+/* One bit per FIFO slot, set by the thread parsing retransmission requests and
+ * cleared by the one serving them. Requests for the same packet coming from
+ * many receivers collapse into a single bit. */
+class rexmit_bitmap {
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    size_t nwords = 0;
+    size_t nbits = 0;
+
+public:
+    void init(size_t bits) {
+        nbits = bits;
+        nwords = (bits + 63) / 64;
+        words = std::make_unique<std::atomic<uint64_t>[]>(nwords);
+        for (size_t i = 0; i < nwords; ++i)
+            words[i].store(0, std::memory_order_relaxed);
+    }
+
+    void set(size_t bit) {
+        words[bit / 64].fetch_or((uint64_t)1 << (bit % 64), std::memory_order_release);
+    }
+
+    /* clears all set bits, calling serve(bit) for each of them in the order of
+     * bits starting at first and wrapping around; once serve returns false the
+     * pass stops, leaving that bit and the ones after it set */
+    template<typename F>
+    void drain(size_t first, F serve) {
+        size_t first_word = first / 64;
+
+        for (size_t n = 0; n <= nwords; ++n) {
+            size_t w = (first_word + n) % nwords;
+            if (words[w].load(std::memory_order_relaxed) == 0)
+                continue;
+
+            /* the first word is split between the very beginning and the very end of the pass */
+            uint64_t mask = ~(uint64_t)0;
+            if (w == first_word && first % 64 != 0)
+                mask = n == 0 ? ~(uint64_t)0 << (first % 64) : ~(~(uint64_t)0 << (first % 64));
+            else if (n == nwords)
+                break;
+
+            uint64_t bits = words[w].fetch_and(~mask, std::memory_order_acquire) & mask;
+            while (bits) {
+                if (!serve(w * 64 + __builtin_ctzll(bits))) {
+                    words[w].fetch_or(bits, std::memory_order_relaxed);
+                    return;
+                }
+                bits &= bits - 1;
+            }
+        }
+    }
+};
+
+
+#endif //RADIO_REXMIT_BITMAP_H
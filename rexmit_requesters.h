@@ -0,0 +1,78 @@
+#ifndef RADIO_REXMIT_REQUESTERS_H
+#define RADIO_REXMIT_REQUESTERS_H
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+/* Who asked for the packet in each FIFO slot, next to rexmit_bitmap: up to
+ * limit distinct receiver addresses per slot, plus the number of distinct
+ * requests seen. Written by the thread parsing requests and emptied by the
+ * one serving them; whenever the two race, the server sees an incomplete
+ * entry and falls back to multicast, which reaches every requester anyway. */
+class rexmit_requesters {
+public:
+    static const size_t MAX_LIMIT = 8;
+
+private:
+    std::unique_ptr<std::atomic<uint32_t>[]> addrs; // limit per slot, 0 if unused
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+    size_t limit = 0;
+
+public:
+    /* limit 0 keeps no addresses, every repair goes by multicast */
+    void init(size_t slots, size_t limit) {
+        this->limit = limit;
+        addrs = std::make_unique<std::atomic<uint32_t>[]>(slots * limit);
+        counts = std::make_unique<std::atomic<uint32_t>[]>(slots);
+        for (size_t i = 0; i < slots * limit; ++i)
+            addrs[i].store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < slots; ++i)
+            counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    /* records a request from addr (network order), to be called before the
+     * slot's bit is set in the bitmap; repeated requests from one receiver
+     * count once; addr 0 (INADDR_ANY) stands for a request made on behalf of
+     * the whole group, repaired by multicast */
+    void add(size_t slot, uint32_t addr) {
+        if (limit == 0)
+            return;
+        if (addr == 0) {
+            counts[slot].fetch_add((uint32_t)limit + 1, std::memory_order_relaxed);
+            return;
+        }
+
+        std::atomic<uint32_t> *entry = &addrs[slot * limit];
+        uint32_t count = counts[slot].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < std::min((size_t)count, limit); ++i) {
+            if (entry[i].load(std::memory_order_relaxed) == addr)
+                return;
+        }
+
+        count = counts[slot].fetch_add(1, std::memory_order_relaxed);
+        if (count < limit)
+            entry[count].store(addr, std::memory_order_relaxed);
+    }
+
+    /* empties the slot after its bit was drained; returns the number of
+     * addresses put in out (limit of them at most), or 0 if the packet has to
+     * go by multicast */
+    size_t take(size_t slot, uint32_t *out) {
+        if (limit == 0)
+            return 0;
+
+        uint32_t count = counts[slot].exchange(0, std::memory_order_relaxed);
+        std::atomic<uint32_t> *entry = &addrs[slot * limit];
+        bool complete = count > 0 && count <= limit;
+        for (size_t i = 0; i < std::min((size_t)count, limit); ++i) {
+            out[i] = entry[i].exchange(0, std::memory_order_relaxed);
+            complete &= out[i] != 0;
+        }
+        return complete ? count : 0;
+    }
+};
+
+
+#endif //RADIO_REXMIT_REQUESTERS_H
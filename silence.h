@@ -0,0 +1,86 @@
+#ifndef RADIO_SILENCE_H
+#define RADIO_SILENCE_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include "audiogram.h"
+#include "input_source.h"
+
+/* Discontinuous transmission: runs of silent audiograms are not sent, a
+ * marker naming the first and the last of them goes to data_port + 3 of the
+ * station's group instead. The marker starts like an audiogram (session id,
+ * id of the first silent packet), followed by the id of the last one.
+ * Receivers that listen there fill the run with zeroed audiograms, which are
+ * silence both as raw PCM and as IMA-ADPCM; those that do not see a gap and
+ * get the packets retransmitted as usual. */
+class silence_marker {
+public:
+    static const size_t SIZE = audiogram::HEADER_SIZE + sizeof(uint64_t);
+    static const in_port_t PORT_OFFSET = 3;
+
+    static void build(uint8_t *marker, uint64_t session_id, uint64_t first_id, uint64_t last_id) {
+        audiogram::set_header(marker, session_id, first_id);
+        uint64_t last = audiogram::htonll(last_id);
+        memcpy(marker + audiogram::HEADER_SIZE, &last, sizeof(last));
+    }
+
+    /* returns 1 if the datagram is not a marker */
+    static int parse(const uint8_t *data, size_t len, uint64_t &session_id, uint64_t &first_id, uint64_t &last_id) {
+        if (len != SIZE)
+            return 1;
+
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        session_id = audiogram::ntohll(value);
+        first_id = audiogram::packet_id_of(data);
+        memcpy(&value, data + audiogram::HEADER_SIZE, sizeof(value));
+        last_id = audiogram::ntohll(value);
+        return last_id < first_id;
+    }
+};
+
+/* Tells whether each piece of 16-bit little-endian PCM read through it stays
+ * within threshold of zero. Sits right above the raw input, below any coder. */
+class silence_detector : public input_source {
+private:
+    std::unique_ptr<input_source> pcm_source;
+    int16_t threshold;
+    bool silent = false;
+
+public:
+    /* true if every sample of pcm is within threshold of zero; no early exit,
+     * so the loop compiles to packed compares */
+    static bool is_silent(const uint8_t *pcm, size_t len, int16_t threshold) {
+        size_t samples = len / sizeof(int16_t);
+        int loud = 0;
+        for (size_t i = 0; i < samples; ++i) {
+            int16_t sample;
+            memcpy(&sample, pcm + i * sizeof(int16_t), sizeof(sample));
+            loud |= (sample > threshold) | (sample < -threshold);
+        }
+        return !loud;
+    }
+
+    silence_detector(std::unique_ptr<input_source> pcm_source, int16_t threshold)
+            : pcm_source(std::move(pcm_source)), threshold(threshold) {}
+
+    int wait_for(size_t len) override {
+        return pcm_source->wait_for(len);
+    }
+
+    int read(uint8_t *dst, size_t len) override {
+        if (pcm_source->read(dst, len))
+            return 1;
+        silent = is_silent(dst, len, threshold);
+        return 0;
+    }
+
+    /* whether the piece read last was silent */
+    bool was_silent() const {
+        return silent;
+    }
+};
+
+
+#endif //RADIO_SILENCE_H
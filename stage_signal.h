@@ -0,0 +1,40 @@
+#ifndef RADIO_STAGE_SIGNAL_H
+#define RADIO_STAGE_SIGNAL_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+/* Lets a pipeline stage sleep until the stage on the other side of a
+ * lock-free ring makes progress. The mutex is only touched when the sleeper
+ * has announced itself, so a running pipeline never locks. Progress has to be
+ * published with sequentially consistent stores before notify(). */
+class stage_signal {
+private:
+    std::mutex mut;
+    std::condition_variable cv;
+    std::atomic<bool> waiting;
+
+public:
+    stage_signal() : waiting(false) {}
+
+    template<typename P>
+    void wait(P ready) {
+        waiting.store(true);
+        if (!ready()) {
+            std::unique_lock<std::mutex> lock(mut);
+            cv.wait(lock, ready);
+        }
+        waiting.store(false);
+    }
+
+    void notify() {
+        if (waiting.load()) {
+            std::lock_guard<std::mutex> lock(mut);
+            cv.notify_all();
+        }
+    }
+};
+
+
+#endif //RADIO_STAGE_SIGNAL_H
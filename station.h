@@ -0,0 +1,755 @@
+#ifndef RADIO_STATION_H
+#define RADIO_STATION_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "audiogram.h"
+#include "audio_batch.h"
+#include "pacer.h"
+#include "input_source.h"
+#include "codec.h"
+#include "silence.h"
+#include "packet_ring.h"
+#include "rexmit_bitmap.h"
+#include "rexmit_requesters.h"
+#include "fec.h"
+#include "nack.h"
+#include "stage_signal.h"
+#include "metrics.h"
+#include "transmitter.h"
+#include "receiver.h"
+#include "const.h"
+
+/* what tells one station of a sender from another */
+struct station_spec {
+    std::string mcast_addr_dotted;
+    in_port_t data_port; // network order
+    std::string name;
+    std::string input_path; // stdin if empty
+};
+
+/* settings shared by all stations of a sender */
+struct station_settings {
+    size_t psize;
+    size_t batch_size;
+    size_t ingest_depth;
+    double rate; // per station, 0 sends as fast as input comes
+    unsigned int rexmit_share;
+    size_t jitter_size;
+    std::chrono::milliseconds rtime;
+    int reader_cpu;
+    size_t fec_block; // audiograms covered by one parity packet, 0 sends no parity
+    size_t unicast_limit; // most receivers a repair goes to by unicast, 0 always multicasts
+    unsigned int codec_channels; // input is PCM of that many channels coded to IMA-ADPCM, 0 sends it as is
+    int silence_threshold; // 16-bit PCM peak up to which audiograms are silent, -1 sends them all
+    unsigned int catch_up_share; // percent of the live rate catch-up bursts may use, 0 answers none
+    bool nack_group; // takes requests on a group receivers share, repaired by multicast
+};
+
+/* One station hosted by the sender: its input, multicast group, FIFO and
+ * reply socket. The reader stage runs on its own thread, sending and
+ * retransmitting are driven by threads the sender shares among stations. */
+class station {
+private:
+    station_spec spec;
+    station_settings settings;
+    struct sockaddr_in mcast_addr = {0};
+    in_port_t audio_port = 0; // host order, the data port or CODEC_PORT_OFFSET above it
+    int send_sock = -1; // shared by all stations
+    transmitter replies_tr; // receivers send retransmission requests here
+    receiver nack_group_rcv; // or to the group, for all receivers to hear; no socket if unused
+    std::string reply_msg;
+    size_t psize = 0;
+    size_t batch_size = 0;
+
+    packet_ring data_q;
+    std::unique_ptr<input_source> source;
+    std::atomic<uint64_t> sent_id; // one past the newest packet handed to the socket
+    std::atomic<bool> input_done;
+    bool finished = false; // the send stage sent the last packet
+    bool idle = false;
+    stage_signal *ingest_ready = nullptr; // the reader committed packets, shared by a send worker
+    stage_signal ingest_space; // the sender freed slots
+    size_t ingest_depth_bytes = 0;
+    audio_batch batch;
+    pacer live_pacer;
+    parity_block fec;
+    struct sockaddr_in fec_addr = {0};
+    std::atomic<uint64_t> parity_sent;
+    silence_detector *detector = nullptr; // in the chain of source, nullptr without DTX
+    std::unique_ptr<std::atomic<bool>[]> silent_slots; // set by the reader stage before commit
+    struct sockaddr_in silence_addr = {0};
+    uint64_t silence_first = 0;
+    size_t silence_run = 0; // silent audiograms held back since silence_first
+    std::atomic<uint64_t> silent_skipped;
+    std::atomic<uint64_t> markers_sent;
+    std::atomic<uint64_t> reader_stalls;
+    std::atomic<uint64_t> sender_stalls;
+    std::atomic<uint64_t> max_occupancy;
+
+    rexmit_bitmap retransmit_slots;
+    /* id last requested in each slot, set before its bit; the slot may hold a
+     * newer packet by the time the bit is drained */
+    std::unique_ptr<std::atomic<uint64_t>[]> requested_ids;
+    rexmit_requesters requesters;
+    audio_batch rexmit_batch;
+    pacer rexmit_pacer;
+    std::vector<uint8_t> staging;
+    audio_batch unicast_batch; // repairs for the few receivers that asked, to one of them at a time
+    struct sockaddr_in unicast_addr = {0};
+    std::vector<uint8_t> unicast_staging;
+    size_t unicast_staged = 0;
+    double min_rexmit_rate = 0; // floor for the repair budget, so repairs go on while live data stalls
+    double live_rate = 0;
+    uint64_t last_live_bytes = 0;
+    pacer::clock::time_point last_estimate;
+    std::atomic<uint64_t> live_bytes;
+    std::atomic<uint64_t> rexmits_sent;
+    std::atomic<uint64_t> rexmits_unicast;
+    std::atomic<uint64_t> rexmits_expired;
+    std::atomic<uint64_t> requests_parsed; // written by the control thread, like the two below
+    std::atomic<uint64_t> requests_rejected;
+    std::atomic<uint64_t> ids_requested;
+    std::atomic<uint64_t> ids_not_held;
+
+    /* bursts of held packets for receivers that just tuned in, one per
+     * receiver; queued by the control thread, sent by the repair thread */
+    struct catch_up_burst {
+        uint32_t to; // network order
+        uint64_t next_id;
+        uint64_t end_id;
+    };
+    static const size_t MAX_CATCH_UPS = 16;
+    std::mutex catch_up_mut;
+    std::vector<catch_up_burst> catch_ups; // guarded by catch_up_mut
+    pacer catch_up_pacer;
+    uint64_t catch_ups_taken = 0; // guarded by catch_up_mut
+    uint64_t catch_ups_dropped = 0; // guarded by catch_up_mut
+    std::atomic<uint64_t> catch_up_sent;
+
+    static void count(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    /* regular files are mapped, anything else is read in large blocks */
+    int open_input() {
+        int fd = STDIN_FILENO;
+        if (!spec.input_path.empty()) {
+            fd = open(spec.input_path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "Error: open " << spec.input_path << ", errno = " << errno << "\n";
+                return 1;
+            }
+        }
+
+        size_t payload = psize - audiogram::HEADER_SIZE;
+        size_t read_size = settings.codec_channels > 0 ? ima_adpcm::pcm_size(payload, settings.codec_channels) : payload;
+        if (mmap_source::is_regular(fd)) {
+            std::unique_ptr<mmap_source> mapped = std::make_unique<mmap_source>();
+            if (mapped->open(fd))
+                return 1;
+            source = std::move(mapped);
+        } else {
+            source = std::make_unique<block_source>(fd, read_size);
+        }
+        if (settings.silence_threshold >= 0) {
+            std::unique_ptr<silence_detector> detecting = std::make_unique<silence_detector>(
+                    std::move(source), (int16_t)settings.silence_threshold);
+            detector = detecting.get();
+            source = std::move(detecting);
+        }
+        if (settings.codec_channels > 0)
+            source = std::make_unique<adpcm_source>(std::move(source), settings.codec_channels, payload);
+
+        if (fd != STDIN_FILENO)
+            close(fd);
+        return 0;
+    }
+
+    /* The lookup reply never changes, so it is formatted once. Extensions
+     * follow the first line, as long as the whole reply fits the receivers'
+     * MAX_CTRL_MSG_LEN buffer; the codec line, which receivers cannot do
+     * without, comes first and always fits. The first line of a coded station
+     * names the data port all receivers know, its audio goes CODEC_PORT_OFFSET
+     * above it. */
+    void build_reply() {
+        // BOREWICZ_HERE [MCAST_ADDR] [DATA_PORT] [nazwa stacji]
+        char msg[MAX_CTRL_MSG_LEN];
+        int msg_size = snprintf(msg, sizeof(msg), "%s %s %d %s\n", REPLY_MSG,
+                spec.mcast_addr_dotted.data(), spec.data_port, spec.name.data());
+        reply_msg = std::string(msg, msg_size > 0 ? std::min((size_t)msg_size, sizeof(msg) - 1) : 0);
+        if (settings.codec_channels > 0)
+            reply_msg.append(ima_adpcm::reply_line(settings.codec_channels));
+        if (reply_msg.size() + strlen(NACK_REPLY_EXT) < MAX_CTRL_MSG_LEN)
+            reply_msg.append(NACK_REPLY_EXT);
+        if (nack_group_rcv.sock >= 0 && reply_msg.size() + strlen(NACK_GROUP_EXT) < MAX_CTRL_MSG_LEN)
+            reply_msg.append(NACK_GROUP_EXT);
+        if (settings.catch_up_share > 0 && reply_msg.size() + strlen(CATCH_UP_REPLY_EXT) < MAX_CTRL_MSG_LEN)
+            reply_msg.append(CATCH_UP_REPLY_EXT);
+    }
+
+    /* joins the group where receivers share retransmission requests, if asked
+     * to and the station has a multicast group and a port for it */
+    void join_nack_group() {
+        if (!settings.nack_group || !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr)) ||
+            audio_port > 65535 - NACK_GROUP_PORT_OFFSET)
+            return;
+
+        struct sockaddr_in group_addr = mcast_addr;
+        group_addr.sin_port = htons((in_port_t)(audio_port + NACK_GROUP_PORT_OFFSET));
+        nack_group_rcv.prepare_to_receive_group(group_addr);
+    }
+
+    void flush_repairs() {
+        if (!rexmit_batch.empty())
+            rexmit_batch.flush(send_sock, mcast_addr);
+        if (!unicast_batch.empty())
+            unicast_batch.flush(send_sock, unicast_addr);
+    }
+
+    static void pin_to_cpu(int cpu) {
+        if (cpu < 0)
+            return;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            std::cerr << "Error: pinning reader stage to cpu " << cpu << ", errno = " << err << "\n";
+    }
+
+public:
+    station() : sent_id(0), input_done(false), parity_sent(0), silent_skipped(0), markers_sent(0),
+                reader_stalls(0), sender_stalls(0), max_occupancy(0), live_bytes(0), rexmits_sent(0),
+                rexmits_unicast(0), rexmits_expired(0), requests_parsed(0), requests_rejected(0),
+                ids_requested(0), ids_not_held(0), catch_up_sent(0) {}
+
+    /* sets the station up on its part of the FIFO arena, packet_ring::footprint() bytes at fifo */
+    int init(const station_spec &spec, const station_settings &settings, int send_sock,
+             uint8_t *fifo, size_t slots, bool resume, stage_signal *ingest_ready) {
+        this->spec = spec;
+        this->settings = settings;
+        this->send_sock = send_sock;
+        this->ingest_ready = ingest_ready;
+        psize = settings.psize;
+
+        if (!inet_pton(AF_INET, spec.mcast_addr_dotted.c_str(), &mcast_addr.sin_addr)) {
+            std::cerr << "the argument ('" << spec.mcast_addr_dotted << "') for option '-a' is invalid\n";
+            return 1;
+        }
+        audio_port = ntohs(spec.data_port);
+        if (settings.codec_channels > 0) {
+            if (audio_port > 65535 - CODEC_PORT_OFFSET) {
+                std::cerr << "no port left for coded audio of station " << spec.name << "\n";
+                return 1;
+            }
+            audio_port += CODEC_PORT_OFFSET;
+        }
+        mcast_addr.sin_family = AF_INET;
+        mcast_addr.sin_port = htons(audio_port);
+        if (settings.fec_block > 0 && audio_port == 65535) {
+            std::cerr << "no port left for parity of station " << spec.name << "\n";
+            return 1;
+        }
+        unicast_addr = mcast_addr;
+        fec_addr = mcast_addr;
+        fec_addr.sin_port = htons((in_port_t)(audio_port + 1));
+        if (settings.silence_threshold >= 0 && audio_port > 65535 - silence_marker::PORT_OFFSET) {
+            std::cerr << "no port left for silence markers of station " << spec.name << "\n";
+            return 1;
+        }
+        silence_addr = mcast_addr;
+        silence_addr.sin_port = htons((in_port_t)(audio_port + silence_marker::PORT_OFFSET));
+        join_nack_group();
+        build_reply();
+        replies_tr.prepare_to_send();
+        fcntl(replies_tr.sock, F_SETFL, O_NONBLOCK);
+
+        data_q.attach(fifo, slots, psize, resume);
+        /* after a restart keep the session, receivers only see a pause */
+        if (!data_q.is_resumed())
+            data_q.start_session((uint64_t)time(nullptr), 0);
+        retransmit_slots.init(data_q.capacity());
+        requested_ids = std::make_unique<std::atomic<uint64_t>[]>(data_q.capacity());
+        for (size_t i = 0; i < data_q.capacity(); ++i)
+            requested_ids[i].store(0, std::memory_order_relaxed);
+        silent_slots = std::make_unique<std::atomic<bool>[]>(data_q.capacity());
+        for (size_t i = 0; i < data_q.capacity(); ++i)
+            silent_slots[i].store(false, std::memory_order_relaxed);
+        requesters.init(data_q.capacity(), settings.unicast_limit);
+        if (open_input())
+            return 1;
+
+        /* batched packets are referenced in data_q until they are flushed */
+        batch_size = settings.batch_size;
+        if (batch_size >= data_q.capacity())
+            batch_size = std::max(data_q.capacity() / 2, (size_t)1);
+        batch.init(send_sock, batch_size, psize);
+        /* the reader may not overwrite packets waiting in the send batch */
+        size_t ingest_depth = settings.ingest_depth;
+        if (ingest_depth + batch_size > data_q.capacity())
+            ingest_depth = std::max(data_q.capacity() - batch_size, (size_t)1);
+        ingest_depth_bytes = ingest_depth * psize;
+        sent_id = data_q.get_end_id();
+        live_pacer.init(settings.rate, batch_size * psize);
+        fec.init(settings.fec_block, psize);
+
+        min_rexmit_rate = (double)(batch_size * psize) * 1000 / settings.rtime.count();
+        live_rate = settings.rate;
+        last_estimate = pacer::clock::now();
+        staging.resize(batch_size * psize);
+        rexmit_batch.init(send_sock, batch_size, psize);
+        unicast_staging.resize(batch_size * psize);
+        unicast_batch.init(send_sock, batch_size, psize);
+        rexmit_pacer.init(std::max(live_rate * settings.rexmit_share / 100, min_rexmit_rate), batch_size * psize);
+        catch_up_pacer.init(std::max(live_rate * settings.catch_up_share / 100, min_rexmit_rate), batch_size * psize);
+
+        if (data_q.is_resumed())
+            std::cerr << spec.name << ": session " << data_q.get_session_id()
+                      << " resumed at packet " << sent_id << "\n";
+        else
+            std::cerr << spec.name << ": session " << data_q.get_session_id() << " sent\n";
+        return 0;
+    }
+
+    const std::string &get_name() const {
+        return spec.name;
+    }
+
+    size_t capacity() const {
+        return data_q.capacity();
+    }
+
+    int get_reply_sock() const {
+        return replies_tr.sock;
+    }
+
+    /* -1 if the station takes no requests sent to its group */
+    int get_nack_group_sock() const {
+        return nack_group_rcv.sock;
+    }
+
+    const std::string &get_reply() const {
+        return reply_msg;
+    }
+
+    bool uses_gso() const {
+        return batch.uses_gso();
+    }
+
+    /* Reader stage: builds packets in data_q ahead of the send stage, at most
+     * ingest_depth of them, so slots waiting to be sent are never reused. */
+    void ingest() {
+        uint64_t packet_id = data_q.get_end_id(), session_id = data_q.get_session_id();
+        size_t payload = psize - audiogram::HEADER_SIZE;
+
+        pin_to_cpu(settings.reader_cpu);
+        while (true) {
+            if (packet_id - sent_id.load() >= ingest_depth_bytes) {
+                count(reader_stalls);
+                ingest_space.wait([&] { return packet_id - sent_id.load() < ingest_depth_bytes; });
+            }
+
+            /* the slot is claimed only once the payload is there, so the end of
+             * input does not evict the oldest packet for nothing */
+            if (source->wait_for(payload))
+                break;
+            uint8_t *packet = data_q.reserve(packet_id);
+            source->read(packet + audiogram::HEADER_SIZE, payload);
+            audiogram::set_header(packet, session_id, packet_id);
+            if (detector != nullptr)
+                silent_slots[data_q.index_of(packet_id)].store(detector->was_silent(), std::memory_order_relaxed);
+            data_q.commit(packet_id);
+            ingest_ready->notify();
+            packet_id += psize;
+        }
+
+        input_done = true;
+        ingest_ready->notify();
+    }
+
+    /* true once the last packet of the input has been sent */
+    bool is_finished() const {
+        return finished;
+    }
+
+    /* true if the send stage has something to do, safe to call from any thread */
+    bool has_work() const {
+        return !finished && (data_q.get_end_id() != sent_id.load() || input_done.load());
+    }
+
+    /* Send stage: hands the packets committed so far to the socket at the
+     * paced rate. Returns the time to wait for tokens, or zero if all ready
+     * packets were sent. Called by one send worker only. */
+    pacer::clock::duration pump() {
+        uint64_t sent = sent_id.load(std::memory_order_relaxed);
+        uint64_t end = data_q.get_end_id();
+        if (sent == end) {
+            live_pacer.pause();
+            if (input_done && data_q.get_end_id() == sent) {
+                if (silence_run > 0)
+                    send_silence();
+                finished = true;
+            }
+            else if (!idle)
+                count(sender_stalls);
+            idle = true;
+            return pacer::clock::duration::zero();
+        }
+        idle = false;
+        if ((end - sent) / psize > max_occupancy.load(std::memory_order_relaxed))
+            max_occupancy.store((end - sent) / psize, std::memory_order_relaxed);
+
+        pacer::clock::duration wait = pacer::clock::duration::zero();
+        for (; sent != end; sent += psize) {
+            wait = live_pacer.delay(psize);
+            if (wait != pacer::clock::duration::zero()) {
+                live_pacer.pause();
+                break;
+            }
+            if (detector != nullptr && silent_slots[data_q.index_of(sent)].load(std::memory_order_relaxed)) {
+                hold_back_silent(sent);
+                live_pacer.consume(psize);
+                sent_id = sent + psize;
+                ingest_space.notify();
+                continue;
+            }
+            if (silence_run > 0)
+                send_silence();
+
+            uint8_t *packet = data_q.find(sent);
+            if (batch.add(packet))
+                batch.flush(send_sock, mcast_addr);
+            live_pacer.consume(psize);
+            if (fec.enabled() && fec.add(packet, data_q.get_session_id()))
+                send_parity();
+            count(live_bytes, psize);
+            sent_id = sent + psize;
+            ingest_space.notify();
+        }
+        /* the worker moves on to other stations, do not hold packets back */
+        if (!batch.empty())
+            batch.flush(send_sock, mcast_addr);
+        return wait;
+    }
+
+    /* Adds a silent audiogram to the run the next marker covers. It takes its
+     * share of the pacer all the same, so the stream keeps its pace. Blocks of
+     * parity with silent audiograms in them are dropped, as receivers zero
+     * those audiograms instead of getting them. */
+    void hold_back_silent(uint64_t packet_id) {
+        if (silence_run == 0)
+            silence_first = packet_id;
+        ++silence_run;
+        count(silent_skipped);
+        fec.cancel();
+        if (silence_run == batch_size)
+            send_silence();
+    }
+
+    /* sends the marker of the run of silent audiograms, after the packets before it */
+    void send_silence() {
+        uint8_t marker[silence_marker::SIZE];
+
+        if (!batch.empty())
+            batch.flush(send_sock, mcast_addr);
+        silence_marker::build(marker, data_q.get_session_id(), silence_first,
+                              silence_first + (silence_run - 1) * psize);
+        silence_run = 0;
+        if (sendto(send_sock, (void *)marker, sizeof(marker), 0,
+                   (struct sockaddr *)&silence_addr, sizeof(silence_addr)) == -1) {
+            std::cerr << "Error: silence sendto, errno = " << errno << "\n";
+            return;
+        }
+        live_pacer.consume(sizeof(marker));
+        count(markers_sent);
+    }
+
+    /* sends the parity of the block just completed, after the packets it covers */
+    void send_parity() {
+        if (!batch.empty())
+            batch.flush(send_sock, mcast_addr);
+        if (sendto(send_sock, (void *)fec.data(), fec.size(), 0,
+                   (struct sockaddr *)&fec_addr, sizeof(fec_addr)) == -1) {
+            std::cerr << "Error: parity sendto, errno = " << errno << "\n";
+            return;
+        }
+        live_pacer.consume(fec.size());
+        count(parity_sent);
+    }
+
+    /* marks a packet requested by the receiver at requester (network order)
+     * for retransmission, returns 1 if it is not held; INADDR_ANY stands for
+     * a request made to the whole group */
+    int request(uint64_t packet_id, uint32_t requester) {
+        long slot = data_q.slot_of(packet_id);
+        count(ids_requested);
+        if (slot < 0) {
+            count(ids_not_held);
+            return 1;
+        }
+        requesters.add((size_t)slot, requester);
+        requested_ids[slot].store(packet_id, std::memory_order_relaxed);
+        retransmit_slots.set((size_t)slot);
+        return 0;
+    }
+
+    /* Serves retransmission requests apart from live data, within rexmit_share
+     * percent of the live rate. Requests are served oldest packet first, as the
+     * oldest ones are the closest to leaving receivers' buffers; packets already
+     * out of the receivers' window (jitter_size) are dropped. A packet asked for
+     * by at most unicast_limit receivers goes to each of them by unicast, at
+     * their address and the station's data port, so the rest of the group is
+     * spared repairs it did not lose. Catch-up bursts go out afterwards.
+     * Never waits for tokens: returns the time until the repairs or bursts
+     * left may go on, or duration::max() if none is left. */
+    pacer::clock::duration retransmit() {
+        if (settings.rate == 0) {
+            pacer::clock::time_point now = pacer::clock::now();
+            uint64_t bytes = live_bytes.load(std::memory_order_relaxed);
+            double elapsed = std::chrono::duration<double>(now - last_estimate).count();
+            if (elapsed > 0)
+                live_rate = (live_rate + (bytes - last_live_bytes) / elapsed) / 2;
+            last_live_bytes = bytes;
+            last_estimate = now;
+            rexmit_pacer.set_rate(std::max(live_rate * settings.rexmit_share / 100, min_rexmit_rate));
+            catch_up_pacer.set_rate(std::max(live_rate * settings.catch_up_share / 100, min_rexmit_rate));
+        }
+
+        uint64_t end = data_q.get_end_id();
+        uint64_t horizon = settings.jitter_size > 0 && end > settings.jitter_size ? end - settings.jitter_size : 0;
+        size_t staged = 0;
+        uint32_t to[rexmit_requesters::MAX_LIMIT];
+
+        pacer::clock::duration wait = pacer::clock::duration::zero();
+        retransmit_slots.drain(data_q.oldest_slot(), [&](size_t slot) {
+            uint64_t packet_id = requested_ids[slot].load(std::memory_order_relaxed);
+            if (data_q.slot_of(packet_id) != (long)slot || packet_id < horizon) {
+                requesters.take(slot, to);
+                count(rexmits_expired);
+                return true;
+            }
+            /* out of tokens: the rest stays requested for the next pass */
+            wait = rexmit_pacer.delay(psize);
+            if (wait != pacer::clock::duration::zero()) {
+                rexmit_pacer.pause();
+                return false;
+            }
+
+            size_t receivers = requesters.take(slot, to);
+            if (receivers > 0) {
+                unicast(packet_id, to, receivers);
+                return true;
+            }
+
+            if (rexmit_batch.empty())
+                staged = 0;
+            uint8_t *packet = staging.data() + staged * psize;
+            if (data_q.copy_out(packet_id, packet)) {
+                count(rexmits_expired);
+                return true;
+            }
+            rexmit_pacer.consume(psize);
+            ++staged;
+            count(rexmits_sent);
+            if (rexmit_batch.add(packet))
+                rexmit_batch.flush(send_sock, mcast_addr);
+            return true;
+        });
+        flush_repairs();
+        pacer::clock::duration catch_up_wait = serve_catch_ups();
+        return wait == pacer::clock::duration::zero() ? catch_up_wait : std::min(wait, catch_up_wait);
+    }
+
+    /* sends a copy of the packet to each of the receivers, batched as long as
+     * consecutive repairs go to the same one */
+    void unicast(uint64_t packet_id, const uint32_t *to, size_t receivers) {
+        uint8_t *packet = stage_unicast(packet_id);
+        if (packet == nullptr) {
+            count(rexmits_expired);
+            return;
+        }
+
+        for (size_t i = 0; i < receivers; ++i) {
+            rexmit_pacer.consume(psize);
+            count(rexmits_sent);
+            count(rexmits_unicast);
+            send_unicast(packet, to[i]);
+        }
+    }
+
+    /* copies the packet to the unicast staging area, nullptr if it is no longer held */
+    uint8_t *stage_unicast(uint64_t packet_id) {
+        if (unicast_staged == batch_size || unicast_batch.empty()) {
+            if (!unicast_batch.empty())
+                unicast_batch.flush(send_sock, unicast_addr);
+            unicast_staged = 0;
+        }
+        uint8_t *packet = unicast_staging.data() + unicast_staged * psize;
+        if (data_q.copy_out(packet_id, packet))
+            return nullptr;
+        ++unicast_staged;
+        return packet;
+    }
+
+    void send_unicast(uint8_t *packet, uint32_t to) {
+        if (!unicast_batch.empty() && unicast_addr.sin_addr.s_addr != to)
+            unicast_batch.flush(send_sock, unicast_addr);
+        unicast_addr.sin_addr.s_addr = to;
+        if (unicast_batch.add(packet))
+            unicast_batch.flush(send_sock, unicast_addr);
+    }
+
+    /* Queues a burst of the packets held from first_id on, count of them at
+     * most, for the receiver at requester (network order). Only packets already
+     * sent live go, so the burst ends where the live stream the receiver hears
+     * begins. Returns 1 if the station answers no catch-up requests or holds
+     * none of the packets. */
+    int catch_up(uint32_t requester, uint64_t first_id, uint32_t count) {
+        uint64_t sent = sent_id.load();
+        first_id = std::max(first_id, data_q.oldest_id());
+        if (settings.catch_up_share == 0 || first_id >= sent || data_q.slot_of(first_id) < 0)
+            return 1;
+        uint64_t end_id = sent - first_id > (uint64_t)count * psize ? first_id + (uint64_t)count * psize : sent;
+
+        std::lock_guard<std::mutex> lock(catch_up_mut);
+        auto same = std::find_if(catch_ups.begin(), catch_ups.end(),
+                                 [&](const catch_up_burst &b) { return b.to == requester; });
+        if (same != catch_ups.end()) {
+            *same = {requester, first_id, end_id};
+        } else if (catch_ups.size() == MAX_CATCH_UPS) {
+            ++catch_ups_dropped;
+            return 1;
+        } else {
+            catch_ups.push_back({requester, first_id, end_id});
+        }
+        ++catch_ups_taken;
+        return 0;
+    }
+
+    /* Sends the queued bursts oldest packet first, within catch_up_share
+     * percent of the live rate for all of them together, as far as the
+     * tokens go without waiting. Each part of a burst the tokens allow, at
+     * most batch_size packets, is taken off the queue under catch_up_mut and
+     * sent after it is released, so catch_up() never waits for a send. */
+    pacer::clock::duration serve_catch_ups() {
+        while (true) {
+            size_t allowed = catch_up_pacer.allowance(psize, batch_size);
+            catch_up_burst part;
+            {
+                std::lock_guard<std::mutex> lock(catch_up_mut);
+                if (catch_ups.empty())
+                    break;
+                if (allowed == 0) {
+                    if (!unicast_batch.empty())
+                        unicast_batch.flush(send_sock, unicast_addr);
+                    return catch_up_pacer.delay(psize);
+                }
+                catch_up_burst &burst = catch_ups.front();
+                part = {burst.to, burst.next_id, std::min(burst.end_id, burst.next_id + allowed * psize)};
+                burst.next_id = part.end_id;
+                if (burst.next_id >= burst.end_id)
+                    catch_ups.erase(catch_ups.begin());
+            }
+
+            for (; part.next_id < part.end_id; part.next_id += psize) {
+                uint8_t *packet = stage_unicast(part.next_id);
+                if (packet == nullptr)
+                    continue;
+                catch_up_pacer.consume(psize);
+                count(catch_up_sent);
+                send_unicast(packet, part.to);
+            }
+        }
+        if (!unicast_batch.empty())
+            unicast_batch.flush(send_sock, unicast_addr);
+        return pacer::clock::duration::max();
+    }
+
+    /* counts a retransmission request taken by the control thread */
+    void count_request(bool parsed) {
+        count(parsed ? requests_parsed : requests_rejected);
+    }
+
+    /* The station's metrics, in the same order for every station. Safe to
+     * call from any thread. */
+    void sample(std::vector<metric_sample> &out) {
+        uint64_t queued = (data_q.get_end_id() - sent_id.load()) / psize;
+        std::unique_lock<std::mutex> lock(catch_up_mut);
+        uint64_t catch_ups = catch_ups_taken;
+        lock.unlock();
+
+        out.push_back({"sikradio_audiograms_sent_total", "Audiograms sent live.", true, live_bytes / psize});
+        out.push_back({"sikradio_bytes_sent_total", "Bytes of audiograms sent live.", true, live_bytes});
+        out.push_back({"sikradio_parity_sent_total", "Parity packets sent.", true, parity_sent});
+        out.push_back({"sikradio_silent_audiograms_total", "Silent audiograms not sent.", true, silent_skipped});
+        out.push_back({"sikradio_silence_markers_total", "Silence markers sent.", true, markers_sent});
+        out.push_back({"sikradio_requests_total", "Retransmission requests parsed.", true, requests_parsed});
+        out.push_back({"sikradio_requests_rejected_total", "Retransmission requests rejected as malformed.",
+                       true, requests_rejected});
+        out.push_back({"sikradio_requested_audiograms_total", "Audiograms asked for in requests.", true,
+                       ids_requested});
+        out.push_back({"sikradio_requested_not_held_total", "Audiograms asked for but no longer held.", true,
+                       ids_not_held});
+        out.push_back({"sikradio_retransmissions_total", "Audiograms retransmitted.", true, rexmits_sent});
+        out.push_back({"sikradio_unicast_retransmissions_total", "Audiograms retransmitted by unicast.", true,
+                       rexmits_unicast});
+        out.push_back({"sikradio_retransmissions_expired_total", "Requested audiograms gone before their turn.",
+                       true, rexmits_expired});
+        out.push_back({"sikradio_catch_ups_total", "Catch-up requests taken.", true, catch_ups});
+        out.push_back({"sikradio_catch_up_audiograms_total", "Audiograms sent in catch-up bursts.", true,
+                       catch_up_sent});
+        out.push_back({"sikradio_fifo_queued_audiograms", "Audiograms built but not yet sent.", false, queued});
+        out.push_back({"sikradio_fifo_max_queued_audiograms", "Most audiograms built but not yet sent.", false,
+                       max_occupancy});
+        out.push_back({"sikradio_reader_stalls_total", "Times the reader waited for the sender.", true,
+                       reader_stalls});
+        out.push_back({"sikradio_sender_stalls_total", "Times the sender waited for input.", true,
+                       sender_stalls});
+    }
+
+    /* statistics, printed by the send worker of the station */
+    void report() {
+        std::cerr << spec.name << ": pacing: achieved " << (uint64_t)live_pacer.achieved_rate() << " B/s";
+        if (live_pacer.enabled())
+            std::cerr << " (target " << (uint64_t)live_pacer.get_rate() << " B/s)";
+        std::cerr << ", burst mean " << live_pacer.mean_burst() << " max "
+                  << live_pacer.get_max_burst() << " audiograms, "
+                  << rexmits_sent << " retransmitted (" << rexmits_sent - rexmits_unicast << " multicast, "
+                  << rexmits_unicast << " unicast), " << rexmits_expired << " expired";
+        if (fec.enabled())
+            std::cerr << ", " << parity_sent << " parity packets";
+        if (detector != nullptr)
+            std::cerr << ", " << silent_skipped << " silent audiograms in " << markers_sent << " markers";
+        if (settings.catch_up_share > 0) {
+            std::lock_guard<std::mutex> lock(catch_up_mut);
+            std::cerr << ", " << catch_ups_taken << " catch-ups (" << catch_ups_dropped << " dropped) in "
+                      << catch_up_sent << " audiograms";
+        }
+        std::cerr << "\n";
+        std::cerr << spec.name << ": ingest: " << (data_q.get_end_id() - sent_id) / psize
+                  << " queued (max " << max_occupancy << " of " << ingest_depth_bytes / psize
+                  << "), reader stalled " << reader_stalls << " times, sender stalled "
+                  << sender_stalls << " times\n";
+    }
+};
+
+
+#endif //RADIO_STATION_H
@@ -45,6 +45,7 @@ public:
 
     virtual int prepare_to_send() {
         prepare_to_send_helper();
+        return 0;
     }
 
     virtual int prepare_to_send_nonblock() {